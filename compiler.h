@@ -50,6 +50,12 @@
 #define BUILD_ASSERT_OR_ZERO(cond) \
 	(sizeof(char [1 - 2*!(cond)]) - 1)
 
+#if defined(__GNUC__) || defined(__clang__)
+#define prefetch(ptr) __builtin_prefetch(ptr)
+#else
+#define prefetch(ptr) ((void)(ptr))
+#endif
+
 #define memclear(mem, size) memset(mem, 0, size)
 #define memclear_2(m1, s1, m2, s2) { memclear(m1, s1); memclear(m2, s2); }
 #define memclear_3(m1, s1, m2, s2, m3, s3) { memclear(m1, s1); memclear(m2, s2); memclear(m3, s3); }
@@ -1,8 +1,21 @@
-
 #ifndef HEX_H
 #define HEX_H
 
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define HEX_AVX2
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HEX_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define HEX_NEON
+#endif
 
 static const char hex_table[256] = {
     ['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3,
@@ -22,11 +35,162 @@ static inline int char_to_hex(unsigned char *val, unsigned char c)
 	return 0;
 }
 
+#if defined(HEX_SSE2)
+// 16 hex chars to 8 bytes. Returns 0 if any of them isn't hex.
+static inline int hex_decode_sse2(const char *str, unsigned char *out,
+				  int upper)
+{
+	__m128i c = _mm_loadu_si128((const __m128i *)str);
+	__m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+	__m128i l = _mm_sub_epi8(upper ? _mm_or_si128(c, _mm_set1_epi8(0x20)) : c,
+				 _mm_set1_epi8('a'));
+	__m128i is_d = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+	__m128i is_l = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(5)), l);
+	__m128i v;
+
+	if (_mm_movemask_epi8(_mm_or_si128(is_d, is_l)) != 0xFFFF)
+		return 0;
+
+	v = _mm_or_si128(_mm_and_si128(is_d, d),
+			 _mm_and_si128(is_l, _mm_add_epi8(l, _mm_set1_epi8(10))));
+
+	// each 16-bit lane holds a high and a low nibble
+	v = _mm_and_si128(_mm_or_si128(_mm_slli_epi16(v, 4), _mm_srli_epi16(v, 8)),
+			  _mm_set1_epi16(0xFF));
+	_mm_storel_epi64((__m128i *)out, _mm_packus_epi16(v, v));
+
+	return 1;
+}
+
+// 16 bytes to 32 lowercase hex chars
+static inline void hex_encode_sse2(const unsigned char *buf, char *dest)
+{
+	__m128i b = _mm_loadu_si128((const __m128i *)buf);
+	__m128i mask = _mm_set1_epi8(0x0F);
+	__m128i hi = _mm_and_si128(_mm_srli_epi16(b, 4), mask);
+	__m128i lo = _mm_and_si128(b, mask);
+	__m128i first = _mm_unpacklo_epi8(hi, lo);
+	__m128i second = _mm_unpackhi_epi8(hi, lo);
+	__m128i nine = _mm_set1_epi8(9);
+	__m128i alpha = _mm_set1_epi8('a' - '0' - 10);
+	__m128i zero = _mm_set1_epi8('0');
+
+	first = _mm_add_epi8(_mm_add_epi8(first, zero),
+			     _mm_and_si128(_mm_cmpgt_epi8(first, nine), alpha));
+	second = _mm_add_epi8(_mm_add_epi8(second, zero),
+			      _mm_and_si128(_mm_cmpgt_epi8(second, nine), alpha));
+
+	_mm_storeu_si128((__m128i *)dest, first);
+	_mm_storeu_si128((__m128i *)(dest + 16), second);
+}
+#endif
+
+#if defined(HEX_AVX2)
+// 32 hex chars to 16 bytes
+static inline int hex_decode_avx2(const char *str, unsigned char *out,
+				  int upper)
+{
+	__m256i c = _mm256_loadu_si256((const __m256i *)str);
+	__m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+	__m256i l = _mm256_sub_epi8(upper ? _mm256_or_si256(c, _mm256_set1_epi8(0x20)) : c,
+				    _mm256_set1_epi8('a'));
+	__m256i is_d = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+	__m256i is_l = _mm256_cmpeq_epi8(_mm256_min_epu8(l, _mm256_set1_epi8(5)), l);
+	__m256i v;
+
+	if (_mm256_movemask_epi8(_mm256_or_si256(is_d, is_l)) != -1)
+		return 0;
+
+	v = _mm256_or_si256(_mm256_and_si256(is_d, d),
+			    _mm256_and_si256(is_l, _mm256_add_epi8(l, _mm256_set1_epi8(10))));
+	v = _mm256_and_si256(_mm256_or_si256(_mm256_slli_epi16(v, 4),
+					     _mm256_srli_epi16(v, 8)),
+			     _mm256_set1_epi16(0xFF));
+
+	// packing works within each 128-bit half, so gather the two
+	// halves' results into the low 128 bits
+	v = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0xD8);
+	_mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(v));
+
+	return 1;
+}
+#endif
+
+#if defined(HEX_NEON)
+// 16 hex chars to 8 bytes
+static inline int hex_decode_neon(const char *str, unsigned char *out,
+				  int upper)
+{
+	uint8x16_t c = vld1q_u8((const uint8_t *)str);
+	uint8x16_t d = vsubq_u8(c, vdupq_n_u8('0'));
+	uint8x16_t l = vsubq_u8(upper ? vorrq_u8(c, vdupq_n_u8(0x20)) : c,
+				vdupq_n_u8('a'));
+	uint8x16_t is_d = vcleq_u8(d, vdupq_n_u8(9));
+	uint8x16_t is_l = vcleq_u8(l, vdupq_n_u8(5));
+	uint16x8_t v;
+
+	if (vminvq_u8(vorrq_u8(is_d, is_l)) != 0xFF)
+		return 0;
+
+	v = vreinterpretq_u16_u8(vbslq_u8(is_d, d, vaddq_u8(l, vdupq_n_u8(10))));
+	vst1_u8(out, vmovn_u16(vorrq_u16(vshlq_n_u16(v, 4), vshrq_n_u16(v, 8))));
+
+	return 1;
+}
+
+// 16 bytes to 32 lowercase hex chars
+static inline void hex_encode_neon(const unsigned char *buf, char *dest)
+{
+	uint8x16_t b = vld1q_u8(buf);
+	uint8x16x2_t out;
+
+	out.val[0] = vshrq_n_u8(b, 4);
+	out.val[1] = vandq_u8(b, vdupq_n_u8(0x0F));
+	out.val[0] = vaddq_u8(vaddq_u8(out.val[0], vdupq_n_u8('0')),
+			      vandq_u8(vcgtq_u8(out.val[0], vdupq_n_u8(9)),
+				       vdupq_n_u8('a' - '0' - 10)));
+	out.val[1] = vaddq_u8(vaddq_u8(out.val[1], vdupq_n_u8('0')),
+			      vandq_u8(vcgtq_u8(out.val[1], vdupq_n_u8(9)),
+				       vdupq_n_u8('a' - '0' - 10)));
+
+	// interleaves the high and low nibble chars
+	vst2q_u8((uint8_t *)dest, out);
+}
+#endif
+
+#if defined(HEX_AVX2) || defined(HEX_SSE2) || defined(HEX_NEON)
+#define HEX_SIMD
+// 32 hex chars to 16 bytes. Uppercase is only accepted if `upper` is set.
+static inline int hex_decode_32(const char *str, unsigned char *out, int upper)
+{
+#if defined(HEX_AVX2)
+	return hex_decode_avx2(str, out, upper);
+#elif defined(HEX_SSE2)
+	return hex_decode_sse2(str, out, upper) &&
+	       hex_decode_sse2(str + 16, out + 8, upper);
+#else
+	return hex_decode_neon(str, out, upper) &&
+	       hex_decode_neon(str + 16, out + 8, upper);
+#endif
+}
+#endif
+
 static inline int hex_decode(const char *str, size_t slen, void *buf, size_t bufsize)
 {
 	unsigned char v1, v2;
 	unsigned char *p = buf;
 
+#ifdef HEX_SIMD
+	// the loop below redoes a chunk with a bad character, so whatever
+	// is valid still gets decoded
+	while (slen >= 32 && bufsize >= 16 && hex_decode_32(str, p, 1)) {
+		str += 32;
+		slen -= 32;
+		p += 16;
+		bufsize -= 16;
+	}
+#endif
+
 	while (slen > 1) {
 		if (!char_to_hex(&v1, str[0]) || !char_to_hex(&v2, str[1]))
 			return 0;
@@ -40,6 +204,41 @@ static inline int hex_decode(const char *str, size_t slen, void *buf, size_t buf
 	return slen == 0 && bufsize == 0;
 }
 
+static inline int hex_is_lower(const char *str, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (!((str[i] >= '0' && str[i] <= '9') ||
+		      (str[i] >= 'a' && str[i] <= 'f')))
+			return 0;
+	}
+
+	return 1;
+}
+
+// Decode n 64-char ids as they appear in events. Since ids are written
+// out as lowercase hex, uppercase strings aren't decoded. ok[i] is set if
+// strs[i] was decoded into ids[i]. Returns the number decoded.
+static inline int hex_decode_ids(const char *const *strs, int n,
+				 unsigned char (*ids)[32], unsigned char *ok)
+{
+	int i, decoded = 0;
+
+	for (i = 0; i < n; i++) {
+#ifdef HEX_SIMD
+		ok[i] = hex_decode_32(strs[i], ids[i], 0) &&
+			hex_decode_32(strs[i] + 32, ids[i] + 16, 0);
+#else
+		ok[i] = hex_is_lower(strs[i], 64) &&
+			hex_decode(strs[i], 64, ids[i], 32);
+#endif
+		decoded += ok[i];
+	}
+
+	return decoded;
+}
+
 
 static inline char hexchar(unsigned int val)
 {
@@ -52,9 +251,19 @@ static inline char hexchar(unsigned int val)
 
 static int hex_encode(const void *buf, size_t bufsize, char *dest, size_t destsize)
 {
-	size_t i;
+	size_t i = 0;
+
+#if defined(HEX_SSE2) || defined(HEX_NEON)
+	for (; i + 16 <= bufsize; i += 16, dest += 32) {
+#if defined(HEX_SSE2)
+		hex_encode_sse2((const unsigned char *)buf + i, dest);
+#else
+		hex_encode_neon((const unsigned char *)buf + i, dest);
+#endif
+	}
+#endif
 
-	for (i = 0; i < bufsize; i++) {
+	for (; i < bufsize; i++) {
 		unsigned int c = ((const unsigned char *)buf)[i];
 		*(dest++) = hexchar(c >> 4);
 		*(dest++) = hexchar(c & 0xF);
@@ -65,4 +274,4 @@ static int hex_encode(const void *buf, size_t bufsize, char *dest, size_t destsi
 }
 
 
-#endif 
+#endif
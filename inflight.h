@@ -0,0 +1,131 @@
+
+#ifndef NDB_INFLIGHT_H
+#define NDB_INFLIGHT_H
+
+// The notes that have been parsed but not committed yet. When the same
+// event comes in from several relays at once, none of the copies are in the
+// db yet, so ingesters claim the note here before verifying it and drop
+// copies that are already claimed. The writer clears the slot after commit.
+//
+// This is best effort: if the probe window is full the note just isn't
+// tracked, and a copy may slip through while another thread is filling in
+// a slot. The set is keyed on the signature as well as the id so that a
+// copy with a bad signature can't shadow the real one.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the size of the set, and how far we probe into it
+#define INFLIGHT_SLOTS 16384
+#define INFLIGHT_PROBES 16
+
+#define NDB_INFLIGHT_EMPTY 0
+#define NDB_INFLIGHT_BUSY  1
+
+struct ndb_inflight_slot {
+	uint64_t state; // empty, busy, or the tag of the id in it
+	unsigned char id[32];
+	unsigned char sig[64];
+};
+
+struct ndb_inflight {
+	struct ndb_inflight_slot *slots;
+	int mask;
+};
+
+static int ndb_inflight_init(struct ndb_inflight *set)
+{
+	set->slots = calloc(INFLIGHT_SLOTS, sizeof(*set->slots));
+	set->mask = INFLIGHT_SLOTS - 1;
+	return set->slots != NULL;
+}
+
+static void ndb_inflight_destroy(struct ndb_inflight *set)
+{
+	free(set->slots);
+	set->slots = NULL;
+}
+
+static inline uint64_t ndb_inflight_tag(const unsigned char *id)
+{
+	uint64_t tag;
+
+	// ids are hashes already, we just stay clear of the slot states
+	memcpy(&tag, id, sizeof(tag));
+	return tag | 2;
+}
+
+static int ndb_inflight_match(struct ndb_inflight_slot *slot, uint64_t tag,
+			      const unsigned char *id,
+			      const unsigned char *sig)
+{
+	if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != tag)
+		return 0;
+
+	if (memcmp(slot->id, id, sizeof(slot->id)) ||
+	    memcmp(slot->sig, sig, sizeof(slot->sig)))
+		return 0;
+
+	// make sure it wasn't cleared and reused while we were comparing
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->state, __ATOMIC_RELAXED) == tag;
+}
+
+// Claim a slot for a note we're about to verify. Returns 0 if a copy of
+// the note is already in flight. Otherwise *slot is the claimed slot, or -1
+// if there was no room.
+static int ndb_inflight_claim(struct ndb_inflight *set,
+			      const unsigned char *id,
+			      const unsigned char *sig, int *slot)
+{
+	struct ndb_inflight_slot *s;
+	uint64_t tag, expected;
+	int i, ind;
+
+	*slot = -1;
+	tag = ndb_inflight_tag(id);
+
+	// look for a copy before claiming anything, it may be sitting past
+	// a slot that was cleared since
+	for (i = 0; i < INFLIGHT_PROBES; i++) {
+		if (ndb_inflight_match(&set->slots[(tag + i) & set->mask],
+				       tag, id, sig))
+			return 0;
+	}
+
+	for (i = 0; i < INFLIGHT_PROBES; i++) {
+		ind = (tag + i) & set->mask;
+		s = &set->slots[ind];
+
+		expected = NDB_INFLIGHT_EMPTY;
+		if (!__atomic_compare_exchange_n(&s->state, &expected,
+						 NDB_INFLIGHT_BUSY, 0,
+						 __ATOMIC_ACQUIRE,
+						 __ATOMIC_RELAXED)) {
+			// someone got here first, it might have been a copy
+			if (expected == tag && ndb_inflight_match(s, tag, id, sig))
+				return 0;
+			continue;
+		}
+
+		memcpy(s->id, id, sizeof(s->id));
+		memcpy(s->sig, sig, sizeof(s->sig));
+		__atomic_store_n(&s->state, tag, __ATOMIC_RELEASE);
+
+		*slot = ind;
+		return 1;
+	}
+
+	return 1;
+}
+
+static void ndb_inflight_clear(struct ndb_inflight *set, int slot)
+{
+	if (slot >= 0) {
+		__atomic_store_n(&set->slots[slot].state, NDB_INFLIGHT_EMPTY,
+				 __ATOMIC_RELEASE);
+	}
+}
+
+#endif /* NDB_INFLIGHT_H */
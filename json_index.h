@@ -0,0 +1,452 @@
+
+#ifndef JSON_INDEX_H
+#define JSON_INDEX_H
+
+// A faster jsmn_parse for complete json documents. Instead of walking the
+// input a byte at a time, each 64 byte block is classified with SIMD into
+// bitmasks of quotes, backslashes, structural characters and whitespace.
+// From those we work out which bytes are inside strings, and only visit
+// the few bytes that start or end a token.
+//
+// The tokens come out exactly as jsmn (strict, with parent links) would
+// make them. Anything unusual, like odd primitives or bad escapes, is
+// reported as an error without trying to match jsmn's error, so callers
+// should let jsmn have a go when this fails.
+
+#include "jsmn.h"
+#include <stdint.h>
+#include <string.h>
+
+// json_index_structural and json_index_whitespace find {}[]:, and ' ',
+// \t, \n, \r. Where there's a byte shuffle they look the low nibble up in a
+// table instead of comparing against each character. The structural table
+// also matches a couple of control characters, but those are never valid
+// outside of strings and get rejected when we look at them.
+#define JSON_INDEX_OPS 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, ':', '{', ',', '}', 0, 0
+#define JSON_INDEX_WS ' ', 100, 100, 100, 17, 100, 113, 2, 100, '\t', '\n', \
+		      112, 100, '\r', 100, 100
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define JSON_INDEX_VEC_SIZE 32
+typedef __m256i json_index_vec;
+#define json_index_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define json_index_eq(v, c) _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))
+#define json_index_bits(v) ((uint64_t)(uint32_t)_mm256_movemask_epi8(v))
+
+static inline __m256i json_index_structural(__m256i v)
+{
+	const __m256i ops = _mm256_setr_epi8(JSON_INDEX_OPS, JSON_INDEX_OPS);
+	return _mm256_cmpeq_epi8(_mm256_shuffle_epi8(ops, v),
+				 _mm256_or_si256(v, _mm256_set1_epi8(0x20)));
+}
+
+static inline __m256i json_index_whitespace(__m256i v)
+{
+	const __m256i ws = _mm256_setr_epi8(JSON_INDEX_WS, JSON_INDEX_WS);
+	return _mm256_cmpeq_epi8(_mm256_shuffle_epi8(ws, v), v);
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define JSON_INDEX_VEC_SIZE 16
+typedef __m128i json_index_vec;
+#define json_index_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define json_index_eq(v, c) _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+#define json_index_bits(v) ((uint64_t)(uint16_t)_mm_movemask_epi8(v))
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+static inline __m128i json_index_structural(__m128i v)
+{
+	const __m128i ops = _mm_setr_epi8(JSON_INDEX_OPS);
+	return _mm_cmpeq_epi8(_mm_shuffle_epi8(ops, v),
+			      _mm_or_si128(v, _mm_set1_epi8(0x20)));
+}
+
+static inline __m128i json_index_whitespace(__m128i v)
+{
+	const __m128i ws = _mm_setr_epi8(JSON_INDEX_WS);
+	return _mm_cmpeq_epi8(_mm_shuffle_epi8(ws, v), v);
+}
+#else
+static inline __m128i json_index_structural(__m128i v)
+{
+	return _mm_or_si128(
+		_mm_or_si128(_mm_or_si128(json_index_eq(v, '{'),
+					  json_index_eq(v, '}')),
+			     _mm_or_si128(json_index_eq(v, '['),
+					  json_index_eq(v, ']'))),
+		_mm_or_si128(json_index_eq(v, ':'), json_index_eq(v, ',')));
+}
+
+static inline __m128i json_index_whitespace(__m128i v)
+{
+	return _mm_or_si128(_mm_or_si128(json_index_eq(v, ' '),
+					 json_index_eq(v, '\t')),
+			    _mm_or_si128(json_index_eq(v, '\n'),
+					 json_index_eq(v, '\r')));
+}
+#endif
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define JSON_INDEX_VEC_SIZE 16
+typedef uint8x16_t json_index_vec;
+#define json_index_load(p) vld1q_u8((const uint8_t *)(p))
+#define json_index_eq(v, c) vceqq_u8(v, vdupq_n_u8(c))
+#define json_index_bits(v) json_index_neon_bits(v)
+
+// neon has no movemask, weigh each lane by its bit and add them up
+static inline uint64_t json_index_neon_bits(uint8x16_t v)
+{
+	static const uint8_t weights[16] = {
+		1, 2, 4, 8, 16, 32, 64, 128,
+		1, 2, 4, 8, 16, 32, 64, 128
+	};
+	uint8x16_t t = vandq_u8(v, vld1q_u8(weights));
+
+	return (uint64_t)vaddv_u8(vget_low_u8(t)) |
+	       ((uint64_t)vaddv_u8(vget_high_u8(t)) << 8);
+}
+
+static inline uint8x16_t json_index_structural(uint8x16_t v)
+{
+	static const uint8_t ops[16] = { JSON_INDEX_OPS };
+	uint8x16_t idx = vandq_u8(v, vdupq_n_u8(0xf));
+	return vceqq_u8(vqtbl1q_u8(vld1q_u8(ops), idx),
+			vorrq_u8(v, vdupq_n_u8(0x20)));
+}
+
+static inline uint8x16_t json_index_whitespace(uint8x16_t v)
+{
+	static const uint8_t ws[16] = { JSON_INDEX_WS };
+	uint8x16_t idx = vandq_u8(v, vdupq_n_u8(0xf));
+	return vceqq_u8(vqtbl1q_u8(vld1q_u8(ws), idx), v);
+}
+#endif
+
+// one bit per byte of a 64 byte block
+struct json_index_block {
+	uint64_t quote;
+	uint64_t backslash;
+	uint64_t structural; // {}[]:,
+	uint64_t whitespace;
+	uint64_t nul;
+};
+
+static inline void json_index_classify(const unsigned char *p,
+				       struct json_index_block *b)
+{
+#ifdef JSON_INDEX_VEC_SIZE
+	json_index_vec v;
+	int i;
+
+	memset(b, 0, sizeof(*b));
+
+	for (i = 0; i < 64; i += JSON_INDEX_VEC_SIZE) {
+		v = json_index_load(p + i);
+
+		b->structural |= json_index_bits(json_index_structural(v)) << i;
+		b->whitespace |= json_index_bits(json_index_whitespace(v)) << i;
+		b->quote |= json_index_bits(json_index_eq(v, '"')) << i;
+		b->backslash |= json_index_bits(json_index_eq(v, '\\')) << i;
+		b->nul |= json_index_bits(json_index_eq(v, 0)) << i;
+	}
+#else
+	uint64_t bit;
+	int i;
+
+	memset(b, 0, sizeof(*b));
+
+	for (i = 0; i < 64; i++) {
+		bit = 1ULL << i;
+		switch (p[i]) {
+		case '{': case '}': case '[': case ']': case ':': case ',':
+			b->structural |= bit;
+			break;
+		case ' ': case '\t': case '\n': case '\r':
+			b->whitespace |= bit;
+			break;
+		case '"':
+			b->quote |= bit;
+			break;
+		case '\\':
+			b->backslash |= bit;
+			break;
+		case 0:
+			b->nul |= bit;
+			break;
+		}
+	}
+#endif
+}
+
+// the bytes escaped by a backslash. *carry is set when the first byte of
+// the next block is escaped
+static inline uint64_t json_index_escaped(uint64_t backslash, uint64_t *carry)
+{
+	uint64_t escaped = *carry;
+	int i;
+
+	backslash &= ~*carry;
+	*carry = 0;
+
+	// escapes are rare enough that we just walk them
+	while (backslash) {
+		i = __builtin_ctzll(backslash);
+		if (i == 63) {
+			*carry = 1;
+			break;
+		}
+		escaped |= 2ULL << i;
+		backslash &= ~(3ULL << i);
+	}
+
+	return escaped;
+}
+
+// check escapes the way jsmn does
+static inline int json_index_valid_escape(const char *js, int len, int pos)
+{
+	int i;
+
+	if (pos >= len)
+		return 0;
+
+	switch (js[pos]) {
+	case '"': case '/': case '\\': case 'b':
+	case 'f': case 'r': case 'n': case 't':
+		return 1;
+	case 'u':
+		if (pos + 4 >= len)
+			return 0;
+		for (i = 1; i <= 4; i++) {
+			char c = js[pos + i];
+			if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+			      (c >= 'A' && c <= 'F')))
+				return 0;
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+// bit i is set if there's an odd number of bits set at or below i
+static inline uint64_t json_index_prefix_xor(uint64_t x)
+{
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+	return x;
+}
+
+static inline jsmntok_t *json_index_alloc(jsmntok_t *tokens,
+					  unsigned int num_tokens, int *toknext)
+{
+	jsmntok_t *tok;
+
+	if ((unsigned int)*toknext >= num_tokens)
+		return NULL;
+
+	tok = &tokens[(*toknext)++];
+	tok->start = tok->end = -1;
+	tok->size = 0;
+	tok->parent = -1;
+	return tok;
+}
+
+// Returns the number of tokens, or a jsmnerr if the caller should fall back
+// to jsmn
+static int json_index_parse(const char *js, int len, jsmntok_t *tokens,
+			    unsigned int num_tokens)
+{
+	struct json_index_block b;
+	unsigned char tail[64];
+	const unsigned char *block;
+	uint64_t escape_carry = 0, string_carry = 0, scalar_carry = 0;
+	uint64_t escaped, quote, in_string, scalar, events, keep, bits;
+	int base, pos, end, i, toknext = 0, toksuper = -1, str_start = -1;
+	int open = 0;
+	jsmntok_t *token, *t;
+	jsmntype_t type;
+	char c;
+
+	for (base = 0; base < len; base += 64) {
+		if (len - base >= 64) {
+			block = (const unsigned char *)js + base;
+		} else {
+			// pad the last block with whitespace
+			memset(tail, ' ', sizeof(tail));
+			memcpy(tail, js + base, len - base);
+			block = tail;
+		}
+
+		json_index_classify(block, &b);
+
+		// like jsmn, we stop at a nul
+		if (b.nul) {
+			i = __builtin_ctzll(b.nul);
+			keep = i ? ~0ULL >> (64 - i) : 0;
+			b.quote &= keep;
+			b.backslash &= keep;
+			b.structural &= keep;
+			b.whitespace |= ~keep;
+			len = base + i;
+		}
+
+		escaped = json_index_escaped(b.backslash, &escape_carry);
+		for (bits = escaped; bits; bits &= bits - 1) {
+			if (!json_index_valid_escape(js, len,
+						     base + __builtin_ctzll(bits)))
+				return JSMN_ERROR_INVAL;
+		}
+
+		quote = b.quote & ~escaped;
+
+		// opening quotes and the bytes after them up to the closing quote
+		in_string = json_index_prefix_xor(quote) ^ string_carry;
+		string_carry = (uint64_t)((int64_t)in_string >> 63);
+
+		// the first byte of each primitive
+		scalar = ~(b.structural | b.whitespace | quote | in_string);
+		events = (b.structural & ~in_string) | quote |
+			 (scalar & ~((scalar << 1) | scalar_carry));
+		scalar_carry = scalar >> 63;
+
+		for (; events; events &= events - 1) {
+			pos = base + __builtin_ctzll(events);
+			c = js[pos];
+
+			switch (c) {
+			case '"':
+				if (str_start == -1) {
+					// nothing inside strings is an event, so
+					// the next one is the closing quote
+					str_start = pos;
+					events &= events - 1;
+					if (!events)
+						break;
+					pos = base + __builtin_ctzll(events);
+				}
+
+				if (!(token = json_index_alloc(tokens, num_tokens, &toknext)))
+					return JSMN_ERROR_NOMEM;
+				token->type = JSMN_STRING;
+				token->start = str_start + 1;
+				token->end = pos;
+				token->parent = toksuper;
+				str_start = -1;
+
+				if (toksuper != -1)
+					tokens[toksuper].size++;
+				break;
+
+			case '{':
+			case '[':
+				if (!(token = json_index_alloc(tokens, num_tokens, &toknext)))
+					return JSMN_ERROR_NOMEM;
+				if (toksuper != -1) {
+					t = &tokens[toksuper];
+					// an object or array can't be a key
+					if (t->type == JSMN_OBJECT)
+						return JSMN_ERROR_INVAL;
+					t->size++;
+					token->parent = toksuper;
+				}
+				token->type = c == '{' ? JSMN_OBJECT : JSMN_ARRAY;
+				token->start = pos;
+				toksuper = toknext - 1;
+				open++;
+				break;
+
+			case '}':
+			case ']':
+				type = c == '}' ? JSMN_OBJECT : JSMN_ARRAY;
+				if (toknext < 1)
+					return JSMN_ERROR_INVAL;
+				token = &tokens[toknext - 1];
+				for (;;) {
+					if (token->start != -1 && token->end == -1) {
+						if (token->type != type)
+							return JSMN_ERROR_INVAL;
+						token->end = pos + 1;
+						toksuper = token->parent;
+						open--;
+						break;
+					}
+					if (token->parent == -1) {
+						if (token->type != type || toksuper == -1)
+							return JSMN_ERROR_INVAL;
+						break;
+					}
+					token = &tokens[token->parent];
+				}
+				break;
+
+			case ':':
+				toksuper = toknext - 1;
+				break;
+
+			case ',':
+				if (toksuper != -1 &&
+				    tokens[toksuper].type != JSMN_ARRAY &&
+				    tokens[toksuper].type != JSMN_OBJECT) {
+					toksuper = tokens[toksuper].parent;
+				}
+				break;
+
+			case '-': case '0': case '1': case '2': case '3':
+			case '4': case '5': case '6': case '7': case '8':
+			case '9': case 't': case 'f': case 'n':
+				// primitives can't be keys
+				if (toksuper != -1) {
+					t = &tokens[toksuper];
+					if (t->type == JSMN_OBJECT ||
+					    (t->type == JSMN_STRING && t->size != 0))
+						return JSMN_ERROR_INVAL;
+				}
+
+				for (end = pos; end < len; end++) {
+					c = js[end];
+					if (c == ' ' || c == '\t' || c == '\n' ||
+					    c == '\r' || c == ',' || c == ']' ||
+					    c == '}')
+						break;
+					if (!((c >= '0' && c <= '9') ||
+					      (c >= 'a' && c <= 'z') ||
+					      (c >= 'A' && c <= 'Z') ||
+					      c == '-' || c == '+' || c == '.'))
+						return JSMN_ERROR_INVAL;
+				}
+
+				// must be followed by a delimiter
+				if (end == len)
+					return JSMN_ERROR_PART;
+
+				if (!(token = json_index_alloc(tokens, num_tokens, &toknext)))
+					return JSMN_ERROR_NOMEM;
+				token->type = JSMN_PRIMITIVE;
+				token->start = pos;
+				token->end = end;
+				token->parent = toksuper;
+
+				if (toksuper != -1)
+					tokens[toksuper].size++;
+				break;
+
+			default:
+				return JSMN_ERROR_INVAL;
+			}
+		}
+	}
+
+	if (str_start != -1 || open != 0)
+		return JSMN_ERROR_PART;
+
+	return toknext;
+}
+
+#endif // JSON_INDEX_H
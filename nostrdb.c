@@ -1,6 +1,7 @@
 
 #include "nostrdb.h"
 #include "jsmn.h"
+#include "json_index.h"
 #include "hex.h"
 #include "cursor.h"
 #include "random.h"
@@ -10,9 +11,15 @@
 #include "threadpool.h"
 #include "protected_queue.h"
 #include "memchr.h"
+#include "inflight.h"
+#include "compiler.h"
 #include <stdlib.h>
 #include <limits.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "bindings/c/profile_json_parser.h"
 #include "bindings/c/profile_builder.h"
@@ -27,6 +34,20 @@ static const int THREAD_QUEUE_BATCH = 4096;
 // the maximum size of inbox queues
 static const int DEFAULT_QUEUE_SIZE = 1000000;
 
+// the size of the chunks ingesters carve note buffers out of
+static const size_t NOTE_CHUNK_SIZE = 4 * 1024 * 1024;
+
+// the fewest ids the stored id filter is sized for, and how many bits it
+// gets per id
+static const uint64_t ID_FILTER_MIN_IDS = 128 * 1024;
+static const int ID_FILTER_BITS_PER_ID = 16;
+
+// the number of lines ndb_import_file hands to an ingester at once
+static const int IMPORT_BATCH = 1024;
+
+// the number of note keys a subscription can have waiting to be polled
+static const int SUBSCRIPTION_QUEUE_SIZE = 4096;
+
 
 #define NDB_PARSED_ID           (1 << 0)
 #define NDB_PARSED_PUBKEY       (1 << 1)
@@ -42,17 +63,12 @@ struct ndb_profile_record_builder {
 	void *flatbuf;
 };
 
-// controls whether to continue or stop the json parser
-enum ndb_idres {
-	NDB_IDRES_CONT,
-	NDB_IDRES_STOP,
-};
-
 // closure data for the id-detecting ingest controller
 struct ndb_ingest_controller
 {
 	MDB_txn *read_txn;
 	struct ndb_lmdb *lmdb;
+	struct ndb_id_filter *ids;
 };
 
 enum ndb_dbs {
@@ -61,6 +77,10 @@ enum ndb_dbs {
 	NDB_DB_PROFILE,
 	NDB_DB_NOTE_ID,
 	NDB_DB_PROFILE_PK,
+	NDB_DB_NOTE_PUBKEY,
+	NDB_DB_NOTE_KIND,
+	NDB_DB_NOTE_TAGS,
+	NDB_DB_NOTE_CREATED_AT,
 	NDB_DBS,
 };
 
@@ -80,8 +100,100 @@ struct ndb_lmdb {
 	MDB_dbi dbs[NDB_DBS];
 };
 
+enum ndb_monitor_msgtype {
+	NDB_MONITOR_QUIT, // kill thread immediately
+	NDB_MONITOR_NOTE, // a note was committed
+};
+
+struct ndb_monitor_msg {
+	enum ndb_monitor_msgtype type;
+	uint64_t note_key;
+};
+
+struct ndb_subscription {
+	uint64_t subid;
+	struct ndb_filter *filters;
+	int num_filters;
+
+	// note keys waiting to be polled
+	struct prot_queue inbox;
+	void *queue_buf;
+
+	// the last note we queued and the last batch we woke it for, so
+	// multiple matching filters only count once
+	uint64_t last_note_key;
+	uint64_t woken_batch;
+
+	// the subscription list holds a reference, and so does anyone polling
+	// or waiting on the inbox. protected by the monitor mutex.
+	int refs;
+};
+
+// A filter in the subscription index. Filters are indexed under each value
+// of their most selective field, or put on the unindexed list when they have
+// nothing to index on.
+struct ndb_sub_entry {
+	uint64_t hash;
+	struct ndb_subscription *sub;
+	struct ndb_filter *filter;
+	struct ndb_sub_entry *next;
+};
+
+struct ndb_sub_index {
+	struct ndb_sub_entry **buckets;
+	int num_buckets; // always a power of two
+	int count;
+	struct ndb_sub_entry *unindexed;
+};
+
+// The notification stage. The writer hands it the keys of notes it just
+// committed, it matches them against subscriptions and wakes subscribers.
+struct ndb_monitor {
+	struct ndb_lmdb *lmdb;
+
+	void *queue_buf;
+	int queue_buflen;
+	pthread_t thread_id;
+	struct prot_queue inbox;
+
+	// protects everything below
+	pthread_mutex_t mutex;
+	uint64_t next_subid;
+	struct ndb_subscription **subscriptions;
+	int num_subscriptions;
+	int subscriptions_cap;
+	struct ndb_sub_index index;
+	ndb_sub_fn callback;
+	void *callback_ctx;
+
+	// references held by pollers and waiters, signaled when one is let go
+	int sub_users;
+	pthread_cond_t sub_released;
+
+	// subids woken in the current batch, only used by the monitor thread
+	uint64_t *woken;
+	int num_woken;
+	int woken_cap;
+	uint64_t batch;
+};
+
+// A blocked bloom filter of every id in the note_id index, so the ingesters
+// can tell that they've never seen an id without going to the db. Each id
+// sets one bit in each of the 8 words of a single 64 byte block.
+//
+// It's built when we open the db and the writer adds ids before it commits
+// them, so it never misses a stored id. It doesn't grow, once there are
+// many more ids than it was sized for it just answers "maybe" more often.
+struct ndb_id_filter {
+	uint64_t *blocks;
+	uint64_t mask; // number of blocks - 1
+};
+
 struct ndb_writer {
 	struct ndb_lmdb *lmdb;
+	struct ndb_monitor *monitor;
+	struct ndb_inflight inflight;
+	struct ndb_id_filter ids;
 
 	void *queue_buf;
 	int queue_buflen;
@@ -96,10 +208,25 @@ struct ndb_ingester {
 };
 
 
+// a thread's reusable read txn, reset between queries
+struct ndb_read_txn {
+	struct ndb *ndb;
+	MDB_txn *txn;
+	int in_use;
+	struct ndb_read_txn *next;
+};
+
 struct ndb {
 	struct ndb_lmdb lmdb;
 	struct ndb_ingester ingester;
 	struct ndb_writer writer;
+	struct ndb_monitor monitor;
+
+	// each querying thread keeps its read txn in read_txn_key. they are
+	// also tracked here so we can abort them on destroy.
+	pthread_key_t read_txn_key;
+	pthread_mutex_t read_txns_lock;
+	struct ndb_read_txn *read_txns;
 	// lmdb environ handles, etc
 };
 
@@ -146,17 +273,107 @@ static int ndb_tsid_compare(const MDB_val *a, const MDB_val *b)
 	return 0;
 }
 
+// A clustered key with an integer and a timestamp
+struct ndb_u64_tsid {
+	uint64_t u64;
+	uint64_t timestamp;
+};
+
+static int ndb_u64_tsid_compare(const MDB_val *a, const MDB_val *b)
+{
+	struct ndb_u64_tsid *tsa = a->mv_data, *tsb = b->mv_data;
+
+	if (tsa->u64 < tsb->u64)
+		return -1;
+	else if (tsa->u64 > tsb->u64)
+		return 1;
+
+	if (tsa->timestamp < tsb->timestamp)
+		return -1;
+	else if (tsa->timestamp > tsb->timestamp)
+		return 1;
+	return 0;
+}
+
+static inline void ndb_u64_tsid_init(struct ndb_u64_tsid *key, uint64_t u64,
+				     uint64_t timestamp)
+{
+	key->u64 = u64;
+	key->timestamp = timestamp;
+}
+
+// Tag index keys are the tag letter, the value type (NDB_PACKED_ID or
+// NDB_PACKED_STR), the value and then the created_at timestamp. Long values
+// are truncated, queries and tag iterators recheck the value.
+#define NDB_TAG_INDEX_MAX_VALUE 128
+#define NDB_TAG_KEY_SIZE (2 + NDB_TAG_INDEX_MAX_VALUE + sizeof(uint64_t))
+
+static int ndb_tag_key_compare(const MDB_val *a, const MDB_val *b)
+{
+	uint64_t tsa, tsb;
+	MDB_val a2 = *a, b2 = *b;
+	a2.mv_size -= sizeof(tsa);
+	b2.mv_size -= sizeof(tsb);
+
+	int cmp = mdb_cmp_memn(&a2, &b2);
+	if (cmp) return cmp;
+
+	memcpy(&tsa, (unsigned char *)a->mv_data + a2.mv_size, sizeof(tsa));
+	memcpy(&tsb, (unsigned char *)b->mv_data + b2.mv_size, sizeof(tsb));
+
+	if (tsa < tsb)
+		return -1;
+	else if (tsa > tsb)
+		return 1;
+	return 0;
+}
+
+static inline int ndb_tag_key_init(unsigned char *buf, char tag,
+				   unsigned char type, const void *value,
+				   int len, uint64_t timestamp)
+{
+	if (len > NDB_TAG_INDEX_MAX_VALUE)
+		len = NDB_TAG_INDEX_MAX_VALUE;
+
+	buf[0] = tag;
+	buf[1] = type;
+	memcpy(buf + 2, value, len);
+	memcpy(buf + 2 + len, &timestamp, sizeof(timestamp));
+
+	return 2 + len + sizeof(timestamp);
+}
+
+static inline int ndb_tag_key_from_str(unsigned char *buf, char tag,
+				       struct ndb_str value, uint64_t timestamp)
+{
+	if (value.flag == NDB_PACKED_ID)
+		return ndb_tag_key_init(buf, tag, NDB_PACKED_ID, value.id, 32,
+					timestamp);
+
+	return ndb_tag_key_init(buf, tag, NDB_PACKED_STR, value.str,
+				strlen(value.str), timestamp);
+}
+
+// the letter of a single-letter tag key like "e" or "p", 0 otherwise
+static inline char ndb_tag_key_letter(struct ndb_str key)
+{
+	// single character keys are always packed
+	if (key.flag != NDB_PACKED_STR || key.str[1] != '\0')
+		return 0;
+	return key.str[0];
+}
+
 static inline void ndb_tsid_low(struct ndb_tsid *key, unsigned char *id)
 {
 	memcpy(key->id, id, 32);
 	key->timestamp = 0;
 }
 
-static inline void ndb_tsid_init(struct ndb_tsid *key, unsigned char *id,
+static inline void ndb_tsid_init(struct ndb_tsid *key, const unsigned char *id,
 				 uint64_t timestamp)
 {
 	memcpy(key->id, id, 32);
-	key->timestamp = 0;
+	key->timestamp = timestamp;
 }
 
 // useful for range-searching for the latest key with a clustered created_at timen
@@ -178,13 +395,37 @@ enum ndb_writer_msgtype {
 };
 
 struct ndb_ingester_event {
-	char *json;
+	const char *json;
 	int len;
+
+	// how to give the json back once we're done with it. NULL means we
+	// own a copy and free it
+	ndb_release_fn release;
+	void *release_ctx;
+};
+
+// Note buffers are carved out of large per-ingester chunks instead of being
+// malloc'd one at a time. Each note holds a reference on its chunk until the
+// writer has committed it, the last reference out frees the chunk.
+struct ndb_note_chunk {
+	int refs;
+	size_t size;
+	size_t used;
+	unsigned char data[0];
+};
+
+// an ingester thread's current chunk
+struct ndb_note_arena {
+	struct ndb_note_chunk *chunk;
 };
 
 struct ndb_writer_note {
 	struct ndb_note *note;
 	size_t note_len;
+	// the chunk the note lives in, or NULL if it was malloc'd
+	struct ndb_note_chunk *chunk;
+	// the note's slot in the writer's inflight set, or -1
+	int inflight;
 };
 
 struct ndb_writer_profile {
@@ -224,6 +465,178 @@ int ndb_note_verify(void *ctx, unsigned char pubkey[32], unsigned char id[32],
 	return 1;
 }
 
+#define NDB_PUBKEY_CACHE_SIZE 64
+
+// pubkeys lifted to curve points while verifying a batch. An author often
+// has several notes in a batch, so this saves redoing the square root.
+struct ndb_pubkey_cache {
+	unsigned char keys[NDB_PUBKEY_CACHE_SIZE][32];
+	secp256k1_xonly_pubkey parsed[NDB_PUBKEY_CACHE_SIZE];
+	unsigned char used[NDB_PUBKEY_CACHE_SIZE];
+};
+
+static secp256k1_xonly_pubkey *
+ndb_pubkey_cache_get(secp256k1_context *ctx, struct ndb_pubkey_cache *cache,
+		     unsigned char pubkey[32])
+{
+	// pubkeys are uniformly distributed, so any byte is a fine hash
+	int i = pubkey[31] % NDB_PUBKEY_CACHE_SIZE;
+
+	if (cache->used[i] && !memcmp(cache->keys[i], pubkey, 32))
+		return &cache->parsed[i];
+
+	if (!secp256k1_xonly_pubkey_parse(ctx, &cache->parsed[i], pubkey)) {
+		cache->used[i] = 0;
+		return NULL;
+	}
+
+	memcpy(cache->keys[i], pubkey, 32);
+	cache->used[i] = 1;
+	return &cache->parsed[i];
+}
+
+// Verify the signatures of a batch of notes, setting ok[i] for each note
+// with a valid signature. Returns the number of valid notes.
+//
+// libsecp256k1 has no batch verification, so each signature is checked on
+// its own, which also tells us exactly which ones are bad. What we do
+// share across the batch is the pubkey parsing.
+static int ndb_note_verify_many(secp256k1_context *ctx,
+				struct ndb_note **notes, int n,
+				unsigned char *ok)
+{
+	struct ndb_pubkey_cache cache;
+	secp256k1_xonly_pubkey *pubkey;
+	struct ndb_note *note;
+	int i, valid = 0;
+
+	memset(cache.used, 0, sizeof(cache.used));
+
+	for (i = 0; i < n; i++) {
+		note = notes[i];
+		pubkey = ndb_pubkey_cache_get(ctx, &cache, note->pubkey);
+		ok[i] = pubkey && secp256k1_schnorrsig_verify(ctx, note->sig,
+							      note->id, 32,
+							      pubkey) > 0;
+		valid += ok[i];
+	}
+
+	return valid;
+}
+
+// The characters NIP-01 escapes when serializing an event for its id,
+// mapped to the character that follows the backslash
+static const char ndb_json_escapes[256] = {
+	['"']  = '"', ['\\'] = '\\', ['\b'] = 'b', ['\f'] = 'f',
+	['\n'] = 'n', ['\r'] = 'r',  ['\t'] = 't',
+};
+
+static void ndb_hash_jsonstr(struct sha256_ctx *ctx, const char *str)
+{
+	const char *run = str;
+	char esc[2] = { '\\', 0 };
+
+	sha256_update(ctx, "\"", 1);
+
+	// hash the runs between escapes directly from the note's strings
+	for (; *str; str++) {
+		if (!(esc[1] = ndb_json_escapes[(unsigned char)*str]))
+			continue;
+		sha256_update(ctx, run, str - run);
+		sha256_update(ctx, esc, 2);
+		run = str + 1;
+	}
+
+	sha256_update(ctx, run, str - run);
+	sha256_update(ctx, "\"", 1);
+}
+
+static void ndb_hash_hexstr(struct sha256_ctx *ctx, unsigned char *id)
+{
+	char hex[67];
+
+	hex[0] = '"';
+	hex_encode(id, 32, hex + 1, sizeof(hex) - 1);
+	hex[65] = '"';
+
+	sha256_update(ctx, hex, 66);
+}
+
+static void ndb_hash_uint(struct sha256_ctx *ctx, uint64_t n)
+{
+	char buf[20];
+	char *p = buf + sizeof(buf);
+
+	do {
+		*--p = '0' + (n % 10);
+		n /= 10;
+	} while (n);
+
+	sha256_update(ctx, p, buf + sizeof(buf) - p);
+}
+
+static void ndb_hash_json_tags(struct sha256_ctx *ctx, struct ndb_note *note)
+{
+	int i, j;
+	struct ndb_str str;
+	struct ndb_iterator iter, *it = &iter;
+	ndb_tags_iterate_start(note, it);
+
+	sha256_update(ctx, "[", 1);
+
+	i = 0;
+	while (ndb_tags_iterate_next(it)) {
+		if (i++ != 0)
+			sha256_update(ctx, ",", 1);
+
+		sha256_update(ctx, "[", 1);
+		for (j = 0; j < it->tag->count; j++) {
+			if (j != 0)
+				sha256_update(ctx, ",", 1);
+
+			str = ndb_note_str(note, &it->tag->strs[j]);
+			if (str.flag == NDB_PACKED_ID)
+				ndb_hash_hexstr(ctx, str.id);
+			else
+				ndb_hash_jsonstr(ctx, str.str);
+		}
+		sha256_update(ctx, "]", 1);
+	}
+
+	sha256_update(ctx, "]", 1);
+}
+
+// Hash the NIP-01 commitment [0,pubkey,created_at,kind,tags,content]
+// straight out of the note, without serializing it into a buffer first
+static void ndb_event_commitment_hash(struct ndb_note *ev, struct sha256 *id)
+{
+	struct sha256_ctx ctx = SHA256_INIT;
+
+	sha256_update(&ctx, "[0,", 3);
+	ndb_hash_hexstr(&ctx, ev->pubkey);
+	sha256_update(&ctx, ",", 1);
+	ndb_hash_uint(&ctx, ev->created_at);
+	sha256_update(&ctx, ",", 1);
+	ndb_hash_uint(&ctx, ev->kind);
+	sha256_update(&ctx, ",", 1);
+	ndb_hash_json_tags(&ctx, ev);
+	sha256_update(&ctx, ",", 1);
+	ndb_hash_jsonstr(&ctx, ndb_note_str(ev, &ev->content).str);
+	sha256_update(&ctx, "]", 1);
+
+	sha256_done(&ctx, id);
+}
+
+// Check that the note's claimed id is the hash of its contents
+static int ndb_note_verify_id(struct ndb_note *note)
+{
+	struct sha256 id;
+
+	ndb_event_commitment_hash(note, &id);
+
+	return !memcmp(id.u.u8, note->id, 32);
+}
+
 static inline int ndb_writer_queue_msgs(struct ndb_writer *writer,
 					struct ndb_writer_msg *msgs,
 					int num_msgs)
@@ -239,64 +652,218 @@ static int ndb_writer_queue_note(struct ndb_writer *writer,
 
 	msg.note.note = note;
 	msg.note.note_len = note_len;
+	msg.note.chunk = NULL;
+	msg.note.inflight = -1;
 
 	return prot_queue_push(&writer->inbox, &msg);
 }
 
-// get some value based on a clustered id key
-int ndb_get_tsid(MDB_txn *txn, struct ndb_lmdb *lmdb, enum ndb_dbs db,
-		 const unsigned char *id, MDB_val *val)
+// get some value based on a clustered id key, using an open cursor on the
+// index
+static int ndb_cursor_get_tsid(MDB_cursor *cur, const unsigned char *id,
+			       MDB_val *val)
 {
 	MDB_val k, v;
-	MDB_cursor *cur;
 	struct ndb_tsid tsid;
-	int success = 0;
 
 	ndb_tsid_high(&tsid, id);
 	k.mv_data = &tsid;
 	k.mv_size = sizeof(tsid);
 
-	mdb_cursor_open(txn, lmdb->dbs[db], &cur);
-
 	// Position cursor at the next key greater than or equal to the specified key
 	if (mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE)) {
 		// Failed :(. It could be the last element?
 		if (mdb_cursor_get(cur, &k, &v, MDB_LAST))
-			goto cleanup;
+			return 0;
 	} else {
 		// if set range worked and our key exists, it should be
 		// the one right before this one
 		if (mdb_cursor_get(cur, &k, &v, MDB_PREV))
-			goto cleanup;
+			return 0;
 	}
 
-	if (memcmp(k.mv_data, id, 32) == 0) {
-		*val = v;
-		success = 1;
-	}
+	if (memcmp(k.mv_data, id, 32) != 0)
+		return 0;
+
+	*val = v;
+	return 1;
+}
+
+// get some value based on a clustered id key
+int ndb_get_tsid(MDB_txn *txn, struct ndb_lmdb *lmdb, enum ndb_dbs db,
+		 const unsigned char *id, MDB_val *val)
+{
+	MDB_cursor *cur;
+	int success;
+
+	if (mdb_cursor_open(txn, lmdb->dbs[db], &cur))
+		return 0;
+
+	success = ndb_cursor_get_tsid(cur, id, val);
 
-cleanup:
 	mdb_cursor_close(cur);
 	return success;
 }
 
-static void *ndb_lookup_by_key(struct ndb *ndb, uint64_t key,
+// Position the cursor on the last entry that is <= key, including all of its
+// duplicates. This is how we start walking created_at-clustered indexes
+// backwards.
+static int ndb_cursor_seek_last_le(MDB_cursor *cur, MDB_val *k, MDB_val *v)
+{
+	MDB_val search = *k;
+	MDB_txn *txn = mdb_cursor_txn(cur);
+	MDB_dbi dbi = mdb_cursor_dbi(cur);
+	unsigned int flags;
+
+	if (mdb_cursor_get(cur, k, v, MDB_SET_RANGE)) {
+		// everything is smaller than our key
+		return mdb_cursor_get(cur, k, v, MDB_LAST) == 0;
+	}
+
+	if (mdb_cmp(txn, dbi, k, &search) == 0) {
+		if (mdb_dbi_flags(txn, dbi, &flags) || !(flags & MDB_DUPSORT))
+			return 1;
+
+		// an exact match, walk to its newest duplicate
+		return mdb_cursor_get(cur, k, v, MDB_LAST_DUP) == 0 &&
+		       mdb_cursor_get(cur, k, v, MDB_GET_CURRENT) == 0;
+	}
+
+	return mdb_cursor_get(cur, k, v, MDB_PREV) == 0;
+}
+
+static struct ndb_read_txn *ndb_new_read_txn(struct ndb *ndb)
+{
+	struct ndb_read_txn *rtxn;
+
+	if (!(rtxn = calloc(1, sizeof(*rtxn))))
+		return NULL;
+
+	if (mdb_txn_begin(ndb->lmdb.env, NULL, MDB_RDONLY, &rtxn->txn)) {
+		ndb_debug("ndb_new_read_txn: mdb_txn_begin failed\n");
+		free(rtxn);
+		return NULL;
+	}
+
+	rtxn->ndb = ndb;
+	pthread_mutex_lock(&ndb->read_txns_lock);
+	rtxn->next = ndb->read_txns;
+	ndb->read_txns = rtxn;
+	pthread_mutex_unlock(&ndb->read_txns_lock);
+
+	pthread_setspecific(ndb->read_txn_key, rtxn);
+	return rtxn;
+}
+
+// Begin a read transaction. Everything looked up with it stays valid until
+// ndb_end_query.
+//
+// Each thread reuses a single read txn (and the reader slot that goes with
+// it) across queries, renewing it here and resetting it in ndb_end_query.
+int ndb_begin_query(struct ndb *ndb, struct ndb_txn *txn)
+{
+	struct ndb_read_txn *rtxn;
+	txn->ndb = ndb;
+
+	rtxn = pthread_getspecific(ndb->read_txn_key);
+
+	if (rtxn == NULL) {
+		if (!(rtxn = ndb_new_read_txn(ndb)))
+			return 0;
+	} else if (rtxn->in_use) {
+		// lmdb only allows one read txn per thread
+		ndb_debug("ndb_begin_query: thread already has a query open\n");
+		return 0;
+	} else if (mdb_txn_renew(rtxn->txn)) {
+		ndb_debug("ndb_begin_query: mdb_txn_renew failed\n");
+		return 0;
+	}
+
+	rtxn->in_use = 1;
+	txn->mdb_txn = rtxn->txn;
+	return 1;
+}
+
+void ndb_end_query(struct ndb_txn *txn)
+{
+	struct ndb_read_txn *rtxn;
+	struct ndb *ndb = txn->ndb;
+
+	rtxn = pthread_getspecific(ndb->read_txn_key);
+
+	if (rtxn == NULL || rtxn->txn != txn->mdb_txn) {
+		ndb_debug("ndb_end_query: txn doesn't belong to this thread\n");
+		return;
+	}
+
+	mdb_txn_reset(rtxn->txn);
+	rtxn->in_use = 0;
+}
+
+// a thread that queried is exiting. Abort its txn while it still owns the
+// reader slot, and stop tracking it.
+static void ndb_read_txn_destroy(void *data)
+{
+	struct ndb_read_txn *rtxn = data, **p;
+	struct ndb *ndb = rtxn->ndb;
+
+	pthread_mutex_lock(&ndb->read_txns_lock);
+	for (p = &ndb->read_txns; *p; p = &(*p)->next) {
+		if (*p == rtxn) {
+			*p = rtxn->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ndb->read_txns_lock);
+
+	mdb_txn_abort(rtxn->txn);
+	free(rtxn);
+}
+
+static int ndb_read_txns_init(struct ndb *ndb)
+{
+	ndb->read_txns = NULL;
+
+	if (pthread_key_create(&ndb->read_txn_key, ndb_read_txn_destroy)) {
+		fprintf(stderr, "ndb_read_txns_init: pthread_key_create failed\n");
+		return 0;
+	}
+
+	pthread_mutex_init(&ndb->read_txns_lock, NULL);
+	return 1;
+}
+
+// abort the read txns of threads that are still around, they can't be
+// querying anymore. Exited threads already cleaned up after themselves.
+static void ndb_read_txns_destroy(struct ndb *ndb)
+{
+	struct ndb_read_txn *rtxn, *next;
+
+	// no destructors run once the key is gone
+	pthread_key_delete(ndb->read_txn_key);
+
+	pthread_mutex_lock(&ndb->read_txns_lock);
+	for (rtxn = ndb->read_txns; rtxn; rtxn = next) {
+		next = rtxn->next;
+		mdb_txn_abort(rtxn->txn);
+		free(rtxn);
+	}
+	ndb->read_txns = NULL;
+	pthread_mutex_unlock(&ndb->read_txns_lock);
+
+	pthread_mutex_destroy(&ndb->read_txns_lock);
+}
+
+static void *ndb_lookup_by_key(struct ndb_txn *txn, uint64_t key,
 			       enum ndb_dbs store, size_t *len)
 {
 	MDB_val k, v;
-	MDB_txn *txn;
 
 	k.mv_data = &key;
 	k.mv_size = sizeof(key);
 
-	if (mdb_txn_begin(ndb->lmdb.env, 0, 0, &txn)) {
-		ndb_debug("ndb_get_note_by_id: mdb_txn_begin failed\n");
-		return NULL;
-	}
-
-	if (mdb_get(txn, ndb->lmdb.dbs[store], &k, &v)) {
-		ndb_debug("ndb_get_profile_by_pubkey: mdb_get note failed\n");
-		mdb_txn_abort(txn);
+	if (mdb_get(txn->mdb_txn, txn->ndb->lmdb.dbs[store], &k, &v)) {
+		ndb_debug("ndb_lookup_by_key: mdb_get note failed\n");
 		return NULL;
 	}
 
@@ -306,58 +873,527 @@ static void *ndb_lookup_by_key(struct ndb *ndb, uint64_t key,
 	return v.mv_data;
 }
 
-static void *ndb_lookup_tsid(struct ndb *ndb, enum ndb_dbs ind,
+static void *ndb_lookup_tsid(struct ndb_txn *txn, enum ndb_dbs ind,
 			     enum ndb_dbs store, const unsigned char *pk,
 			     size_t *len)
 {
 	MDB_val k, v;
-	MDB_txn *txn;
 	void *res = NULL;
 	if (len)
 		*len = 0;
 
-	if (mdb_txn_begin(ndb->lmdb.env, 0, 0, &txn)) {
-		ndb_debug("ndb_get_note_by_id: mdb_txn_begin failed\n");
-		return NULL;
-	}
-
-	if (!ndb_get_tsid(txn, &ndb->lmdb, ind, pk, &k)) {
+	if (!ndb_get_tsid(txn->mdb_txn, &txn->ndb->lmdb, ind, pk, &k)) {
 		//ndb_debug("ndb_get_profile_by_pubkey: ndb_get_tsid failed\n");
-		goto cleanup;
+		return NULL;
 	}
 
-	if (mdb_get(txn, ndb->lmdb.dbs[store], &k, &v)) {
+	if (mdb_get(txn->mdb_txn, txn->ndb->lmdb.dbs[store], &k, &v)) {
 		ndb_debug("ndb_get_profile_by_pubkey: mdb_get note failed\n");
-		goto cleanup;
+		return NULL;
 	}
 
 	res = v.mv_data;
 	assert(((uint64_t)res % 4) == 0);
 	if (len)
 		*len = v.mv_size;
-cleanup:
-	mdb_txn_abort(txn);
 	return res;
 }
 
-void *ndb_get_profile_by_pubkey(struct ndb *ndb, const unsigned char *pk, size_t *len)
+void *ndb_get_profile_by_pubkey(struct ndb_txn *txn, const unsigned char *pk, size_t *len)
 {
-	return ndb_lookup_tsid(ndb, NDB_DB_PROFILE_PK, NDB_DB_PROFILE, pk, len);
+	return ndb_lookup_tsid(txn, NDB_DB_PROFILE_PK, NDB_DB_PROFILE, pk, len);
 }
 
-struct ndb_note *ndb_get_note_by_id(struct ndb *ndb, const unsigned char *id, size_t *len)
+struct ndb_note *ndb_get_note_by_id(struct ndb_txn *txn, const unsigned char *id, size_t *len)
 {
-	return ndb_lookup_tsid(ndb, NDB_DB_NOTE_ID, NDB_DB_NOTE, id, len);
+	return ndb_lookup_tsid(txn, NDB_DB_NOTE_ID, NDB_DB_NOTE, id, len);
 }
 
-struct ndb_note *ndb_get_note_by_key(struct ndb *ndb, uint64_t key, size_t *len)
+struct ndb_note *ndb_get_note_by_key(struct ndb_txn *txn, uint64_t key, size_t *len)
 {
-	return ndb_lookup_by_key(ndb, key, NDB_DB_NOTE, len);
+	return ndb_lookup_by_key(txn, key, NDB_DB_NOTE, len);
 }
 
-static int ndb_has_note(MDB_txn *txn, struct ndb_lmdb *lmdb, const unsigned char *id)
-{
-	MDB_val val;
+struct ndb_id_ref {
+	const unsigned char *id;
+	uint64_t key;
+	int index;
+};
+
+static int ndb_id_ref_compare(const void *a, const void *b)
+{
+	const struct ndb_id_ref *ra = a, *rb = b;
+	return memcmp(ra->id, rb->id, 32);
+}
+
+static int ndb_id_ref_key_compare(const void *a, const void *b)
+{
+	const struct ndb_id_ref *ra = a, *rb = b;
+
+	if (ra->key < rb->key)
+		return -1;
+	else if (ra->key > rb->key)
+		return 1;
+	return 0;
+}
+
+// Look up many clustered ids at once. The ids are sorted before walking the
+// index, and the primary keys we find are sorted before walking the store,
+// so each cursor moves forward over its B-tree touching each page once.
+// Missing entries are set to NULL. Returns the number found.
+static int ndb_lookup_tsids(struct ndb_txn *txn, enum ndb_dbs ind,
+			    enum ndb_dbs store, const unsigned char *ids,
+			    int n, void **out, size_t *lens)
+{
+	MDB_val k, v;
+	MDB_cursor *cur;
+	struct ndb_id_ref *refs;
+	int i, nkeys = 0, found = 0;
+
+	for (i = 0; i < n; i++) {
+		out[i] = NULL;
+		if (lens)
+			lens[i] = 0;
+	}
+
+	if (n <= 0)
+		return 0;
+
+	if (!(refs = malloc(sizeof(*refs) * n)))
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		refs[i].id = ids + (i * 32);
+		refs[i].index = i;
+	}
+
+	qsort(refs, n, sizeof(*refs), ndb_id_ref_compare);
+
+	// id -> primary key, keeping only the ids we have
+	if (mdb_cursor_open(txn->mdb_txn, txn->ndb->lmdb.dbs[ind], &cur))
+		goto done;
+
+	for (i = 0; i < n; i++) {
+		if (!ndb_cursor_get_tsid(cur, refs[i].id, &v))
+			continue;
+
+		refs[nkeys] = refs[i];
+		refs[nkeys++].key = *(uint64_t *)v.mv_data;
+	}
+
+	mdb_cursor_close(cur);
+
+	qsort(refs, nkeys, sizeof(*refs), ndb_id_ref_key_compare);
+
+	// primary key -> value
+	if (mdb_cursor_open(txn->mdb_txn, txn->ndb->lmdb.dbs[store], &cur))
+		goto done;
+
+	for (i = 0; i < nkeys; i++) {
+		k.mv_data = &refs[i].key;
+		k.mv_size = sizeof(refs[i].key);
+
+		if (mdb_cursor_get(cur, &k, &v, MDB_SET_KEY))
+			continue;
+
+		out[refs[i].index] = v.mv_data;
+		if (lens)
+			lens[refs[i].index] = v.mv_size;
+		found++;
+	}
+
+	mdb_cursor_close(cur);
+done:
+	free(refs);
+	return found;
+}
+
+// Fetch the notes for `n` 32-byte ids packed back to back in `ids`. notes[i]
+// is NULL if we don't have ids[i]. Returns the number of notes found.
+int ndb_get_notes_by_ids(struct ndb_txn *txn, const unsigned char *ids, int n,
+			 struct ndb_note **notes, size_t *lens)
+{
+	return ndb_lookup_tsids(txn, NDB_DB_NOTE_ID, NDB_DB_NOTE, ids, n,
+				(void **)notes, lens);
+}
+
+// Fetch the profile records for `n` 32-byte pubkeys packed back to back
+int ndb_get_profiles_by_pubkeys(struct ndb_txn *txn,
+				const unsigned char *pubkeys, int n,
+				void **profiles, size_t *lens)
+{
+	return ndb_lookup_tsids(txn, NDB_DB_PROFILE_PK, NDB_DB_PROFILE, pubkeys,
+				n, profiles, lens);
+}
+
+static int ndb_note_iter_open(struct ndb_txn *txn, struct ndb_note_iter *iter,
+			      enum ndb_dbs db)
+{
+	MDB_cursor *cur;
+
+	iter->txn = txn;
+	iter->cursor = NULL;
+	iter->flags = 0;
+	iter->started = 0;
+	iter->note = NULL;
+	iter->note_len = 0;
+	iter->note_key = 0;
+	iter->has_next = 0;
+	iter->value = NULL;
+
+	if (mdb_cursor_open(txn->mdb_txn, txn->ndb->lmdb.dbs[db], &cur)) {
+		ndb_debug("ndb_note_iter_open: mdb_cursor_open failed\n");
+		return 0;
+	}
+
+	iter->cursor = cur;
+	return 1;
+}
+
+// Walk a pubkey's notes newest first, starting at `start`. Notes are valid
+// until the txn ends.
+int ndb_note_iter_start_author(struct ndb_txn *txn, struct ndb_note_iter *iter,
+			       const unsigned char *pubkey, uint64_t start)
+{
+	struct ndb_tsid tsid;
+
+	ndb_tsid_init(&tsid, pubkey, start);
+	memcpy(iter->key, &tsid, sizeof(tsid));
+	iter->keylen = sizeof(tsid);
+	iter->index = NDB_ITER_AUTHOR;
+
+	return ndb_note_iter_open(txn, iter, NDB_DB_NOTE_PUBKEY);
+}
+
+// Walk the notes of a kind newest first, starting at `start`
+int ndb_note_iter_start_kind(struct ndb_txn *txn, struct ndb_note_iter *iter,
+			     uint32_t kind, uint64_t start)
+{
+	struct ndb_u64_tsid key;
+
+	ndb_u64_tsid_init(&key, kind, start);
+	memcpy(iter->key, &key, sizeof(key));
+	iter->keylen = sizeof(key);
+	iter->index = NDB_ITER_KIND;
+
+	return ndb_note_iter_open(txn, iter, NDB_DB_NOTE_KIND);
+}
+
+// Walk every note newest first by created_at, starting at `start`
+int ndb_note_iter_start_created_at(struct ndb_txn *txn, struct ndb_note_iter *iter,
+				   uint64_t start)
+{
+	memcpy(iter->key, &start, sizeof(start));
+	iter->keylen = sizeof(start);
+	iter->index = NDB_ITER_CREATED_AT;
+
+	return ndb_note_iter_open(txn, iter, NDB_DB_NOTE_CREATED_AT);
+}
+
+// Walk notes tagged with a single-letter tag and a string value, newest
+// first. `value` has to stay around until ndb_note_iter_end.
+int ndb_note_iter_start_tag_str(struct ndb_txn *txn, struct ndb_note_iter *iter,
+				char tag, const char *value, uint64_t start)
+{
+	int len = strlen(value);
+
+	BUILD_ASSERT(sizeof(iter->key) >= NDB_TAG_KEY_SIZE);
+
+	iter->keylen = ndb_tag_key_init(iter->key, tag, NDB_PACKED_STR, value,
+					len, start);
+	iter->index = NDB_ITER_TAG;
+
+	if (!ndb_note_iter_open(txn, iter, NDB_DB_NOTE_TAGS))
+		return 0;
+
+	// the index only has a prefix of long values
+	if (len > NDB_TAG_INDEX_MAX_VALUE)
+		iter->value = value;
+
+	return 1;
+}
+
+// Walk notes tagged with a single-letter tag and a 32-byte id, newest first
+int ndb_note_iter_start_tag_id(struct ndb_txn *txn, struct ndb_note_iter *iter,
+			       char tag, const unsigned char *id, uint64_t start)
+{
+	iter->keylen = ndb_tag_key_init(iter->key, tag, NDB_PACKED_ID, id, 32,
+					start);
+	iter->index = NDB_ITER_TAG;
+
+	return ndb_note_iter_open(txn, iter, NDB_DB_NOTE_TAGS);
+}
+
+// Walk the note store itself by note key, starting at `start`
+int ndb_note_iter_start_note_key(struct ndb_txn *txn, struct ndb_note_iter *iter,
+				 uint64_t start)
+{
+	memcpy(iter->key, &start, sizeof(start));
+	iter->keylen = sizeof(start);
+	iter->index = NDB_ITER_NOTE_KEY;
+
+	return ndb_note_iter_open(txn, iter, NDB_DB_NOTE);
+}
+
+// Change the walk order or turn on prefetching. Must be called before the
+// first ndb_note_iter_next. When ascending, the start key is the lowest key
+// we visit instead of the highest.
+void ndb_note_iter_set_flags(struct ndb_note_iter *iter, int flags)
+{
+	iter->flags = flags;
+}
+
+// move the cursor to the next index entry in walk order
+static int ndb_note_iter_step(struct ndb_note_iter *iter, MDB_val *k, MDB_val *v)
+{
+	MDB_cursor *cur = iter->cursor;
+	size_t prefix_len = iter->keylen - sizeof(uint64_t);
+	int ascending = iter->flags & NDB_ITER_ASCENDING;
+
+	if (!iter->started) {
+		iter->started = 1;
+		k->mv_data = iter->key;
+		k->mv_size = iter->keylen;
+
+		if (ascending) {
+			if (mdb_cursor_get(cur, k, v, MDB_SET_RANGE))
+				return 0;
+		} else if (!ndb_cursor_seek_last_le(cur, k, v)) {
+			return 0;
+		}
+	} else if (mdb_cursor_get(cur, k, v, ascending ? MDB_NEXT : MDB_PREV)) {
+		return 0;
+	}
+
+	// the note store has no prefix to stay within
+	if (iter->index == NDB_ITER_NOTE_KEY)
+		return 1;
+
+	return k->mv_size == (size_t)iter->keylen &&
+	       !memcmp(k->mv_data, iter->key, prefix_len);
+}
+
+// does the note have a `tag` tag with exactly this string value
+static int ndb_note_has_tag_str(struct ndb_note *note, char tag,
+				const char *value)
+{
+	struct ndb_iterator iter, *it = &iter;
+	struct ndb_str str;
+
+	ndb_tags_iterate_start(note, it);
+
+	while (ndb_tags_iterate_next(it)) {
+		if (it->tag->count < 2 ||
+		    ndb_tag_key_letter(ndb_iter_tag_str(it, 0)) != tag)
+			continue;
+
+		str = ndb_iter_tag_str(it, 1);
+		if (str.flag != NDB_PACKED_ID && !strcmp(str.str, value))
+			return 1;
+	}
+
+	return 0;
+}
+
+// step and resolve the note the entry points to
+static int ndb_note_iter_fetch(struct ndb_note_iter *iter,
+			       struct ndb_note **note, size_t *note_len,
+			       uint64_t *note_key)
+{
+	MDB_val k, v;
+
+	do {
+		if (!iter->cursor || !ndb_note_iter_step(iter, &k, &v))
+			return 0;
+
+		if (iter->index == NDB_ITER_NOTE_KEY) {
+			*note_key = *(uint64_t *)k.mv_data;
+		} else {
+			*note_key = *(uint64_t *)v.mv_data;
+			k.mv_data = note_key;
+			k.mv_size = sizeof(*note_key);
+
+			if (mdb_get(iter->txn->mdb_txn,
+				    iter->txn->ndb->lmdb.dbs[NDB_DB_NOTE], &k, &v))
+				return 0;
+		}
+
+	// skip notes whose value only shares the indexed prefix
+	} while (iter->value &&
+		 !ndb_note_has_tag_str(v.mv_data, iter->key[0], iter->value));
+
+	*note = v.mv_data;
+	*note_len = v.mv_size;
+	return 1;
+}
+
+int ndb_note_iter_next(struct ndb_note_iter *iter)
+{
+	if (!(iter->flags & NDB_ITER_PREFETCH)) {
+		return ndb_note_iter_fetch(iter, &iter->note, &iter->note_len,
+					   &iter->note_key);
+	}
+
+	// stay one note ahead so it's on its way into cache while the
+	// caller looks at the current one
+	if (!iter->started) {
+		iter->has_next = ndb_note_iter_fetch(iter, &iter->next_note,
+						     &iter->next_len,
+						     &iter->next_key);
+	}
+
+	if (!iter->has_next)
+		return 0;
+
+	iter->note = iter->next_note;
+	iter->note_len = iter->next_len;
+	iter->note_key = iter->next_key;
+
+	iter->has_next = ndb_note_iter_fetch(iter, &iter->next_note,
+					     &iter->next_len, &iter->next_key);
+	if (iter->has_next)
+		prefetch(iter->next_note);
+
+	return 1;
+}
+
+// Call `fn` with each remaining note until it returns 0. Returns the number
+// of notes visited.
+int ndb_note_iter_foreach(struct ndb_note_iter *iter, ndb_note_iter_fn fn,
+			  void *ctx)
+{
+	int count = 0;
+
+	while (ndb_note_iter_next(iter)) {
+		count++;
+		if (!fn(ctx, iter->note, iter->note_len, iter->note_key))
+			break;
+	}
+
+	return count;
+}
+
+void ndb_note_iter_end(struct ndb_note_iter *iter)
+{
+	if (iter->cursor)
+		mdb_cursor_close(iter->cursor);
+
+	iter->cursor = NULL;
+}
+
+static inline void ndb_id_filter_hash(const unsigned char *id,
+				      uint64_t *block, uint64_t *bits)
+{
+	// ids are already hashes
+	memcpy(block, id, sizeof(*block));
+	memcpy(bits, id + 8, sizeof(*bits));
+}
+
+static void ndb_id_filter_add(struct ndb_id_filter *filter,
+			      const unsigned char *id)
+{
+	uint64_t block, bits, *words;
+	int i;
+
+	ndb_id_filter_hash(id, &block, &bits);
+	words = filter->blocks + (block & filter->mask) * 8;
+
+	// ingesters read these while we write them
+	for (i = 0; i < 8; i++) {
+		__atomic_fetch_or(&words[i], 1ULL << ((bits >> (i * 6)) & 63),
+				  __ATOMIC_RELAXED);
+	}
+}
+
+// 0 if we definitely don't have the id, 1 if we might
+static int ndb_id_filter_maybe_has(struct ndb_id_filter *filter,
+				   const unsigned char *id)
+{
+	uint64_t block, bits, *words, bit;
+	int i;
+
+	ndb_id_filter_hash(id, &block, &bits);
+	words = filter->blocks + (block & filter->mask) * 8;
+
+	for (i = 0; i < 8; i++) {
+		bit = 1ULL << ((bits >> (i * 6)) & 63);
+		if (!(__atomic_load_n(&words[i], __ATOMIC_RELAXED) & bit))
+			return 0;
+	}
+
+	return 1;
+}
+
+// size the filter for the ids in the db and add them all
+static int ndb_id_filter_init(struct ndb_id_filter *filter,
+			      struct ndb_lmdb *lmdb)
+{
+	MDB_txn *txn;
+	MDB_cursor *cur;
+	MDB_stat st;
+	MDB_val k, v;
+	uint64_t num_ids, num_blocks;
+	size_t size;
+	int rc;
+
+	filter->blocks = NULL;
+
+	if ((rc = mdb_txn_begin(lmdb->env, NULL, MDB_RDONLY, &txn))) {
+		fprintf(stderr, "ndb_id_filter_init: txn begin failed, error %d\n", rc);
+		return 0;
+	}
+
+	if ((rc = mdb_stat(txn, lmdb->dbs[NDB_DB_NOTE_ID], &st))) {
+		fprintf(stderr, "ndb_id_filter_init: stat failed, error %d\n", rc);
+		goto fail;
+	}
+
+	// leave room for the db to double before it gets crowded
+	num_ids = st.ms_entries * 2;
+	if (num_ids < ID_FILTER_MIN_IDS)
+		num_ids = ID_FILTER_MIN_IDS;
+	num_blocks = 1;
+	while (num_blocks * 512 < num_ids * ID_FILTER_BITS_PER_ID)
+		num_blocks <<= 1;
+
+	size = num_blocks * 64;
+	if (posix_memalign((void **)&filter->blocks, 64, size)) {
+		filter->blocks = NULL;
+		fprintf(stderr, "ndb_id_filter_init: couldn't allocate %zu bytes\n", size);
+		goto fail;
+	}
+	memset(filter->blocks, 0, size);
+	filter->mask = num_blocks - 1;
+
+	if ((rc = mdb_cursor_open(txn, lmdb->dbs[NDB_DB_NOTE_ID], &cur))) {
+		fprintf(stderr, "ndb_id_filter_init: cursor open failed, error %d\n", rc);
+		goto fail;
+	}
+
+	// the id is the first part of each clustered key
+	while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0)
+		ndb_id_filter_add(filter, k.mv_data);
+
+	mdb_cursor_close(cur);
+	mdb_txn_abort(txn);
+	return 1;
+
+fail:
+	free(filter->blocks);
+	filter->blocks = NULL;
+	mdb_txn_abort(txn);
+	return 0;
+}
+
+static void ndb_id_filter_destroy(struct ndb_id_filter *filter)
+{
+	free(filter->blocks);
+	filter->blocks = NULL;
+}
+
+static int ndb_has_note(MDB_txn *txn, struct ndb_lmdb *lmdb, const unsigned char *id)
+{
+	MDB_val val;
 
 	if (!ndb_get_tsid(txn, lmdb, NDB_DB_NOTE_ID, id, &val))
 		return 0;
@@ -365,6 +1401,813 @@ static int ndb_has_note(MDB_txn *txn, struct ndb_lmdb *lmdb, const unsigned char
 	return 1;
 }
 
+// the filter element buffer holds field headers and elements, the data buffer
+// holds the ids and strings they point to
+#define NDB_FILTER_ELEM_BUF_SIZE (1024 * 16)
+#define NDB_FILTER_DATA_BUF_SIZE (1024 * 48)
+
+int ndb_filter_init(struct ndb_filter *filter)
+{
+	unsigned char *buf;
+	int size = NDB_FILTER_ELEM_BUF_SIZE + NDB_FILTER_DATA_BUF_SIZE;
+
+	// one chunk upfront, split between the two buffers
+	if (!(buf = malloc(size)))
+		return 0;
+
+	make_cursor(buf, buf + NDB_FILTER_ELEM_BUF_SIZE, &filter->elem_buf);
+	make_cursor(buf + NDB_FILTER_ELEM_BUF_SIZE, buf + size, &filter->data_buf);
+	filter->num_elements = 0;
+	filter->current = NULL;
+
+	return 1;
+}
+
+void ndb_filter_destroy(struct ndb_filter *filter)
+{
+	// the element buffer owns the whole allocation
+	if (filter->elem_buf.start)
+		free(filter->elem_buf.start);
+
+	filter->elem_buf.start = NULL;
+	filter->num_elements = 0;
+	filter->current = NULL;
+}
+
+static struct ndb_filter_elements *
+ndb_filter_get_elements(struct ndb_filter *filter, enum ndb_filter_fieldtype type)
+{
+	for (int i = 0; i < filter->num_elements; i++) {
+		if (filter->elements[i]->field.type == type)
+			return filter->elements[i];
+	}
+
+	return NULL;
+}
+
+static int ndb_filter_has_tag_field(struct ndb_filter *filter, char tag)
+{
+	for (int i = 0; i < filter->num_elements; i++) {
+		if (filter->elements[i]->field.type == NDB_FILTER_TAGS &&
+		    filter->elements[i]->field.generic == tag)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int ndb_filter_start_field_internal(struct ndb_filter *filter,
+					   struct ndb_filter_field *field)
+{
+	struct ndb_filter_elements *els;
+
+	// we're already building a field, or we're full
+	if (filter->current || filter->num_elements == NDB_MAX_FILTER_FIELDS)
+		return 0;
+
+	if (!(els = cursor_malloc(&filter->elem_buf, sizeof(*els))))
+		return 0;
+
+	els->field = *field;
+	els->count = 0;
+	filter->current = els;
+
+	return 1;
+}
+
+int ndb_filter_start_field(struct ndb_filter *filter,
+			   enum ndb_filter_fieldtype type)
+{
+	struct ndb_filter_field field;
+
+	// tag fields are started with ndb_filter_start_tag_field, everything
+	// else can only show up once
+	if (type == NDB_FILTER_TAGS || ndb_filter_get_elements(filter, type))
+		return 0;
+
+	field.type = type;
+	field.elem_type = NDB_ELEMENT_UNKNOWN;
+	field.generic = 0;
+
+	return ndb_filter_start_field_internal(filter, &field);
+}
+
+int ndb_filter_start_tag_field(struct ndb_filter *filter, char tag)
+{
+	struct ndb_filter_field field;
+
+	if (ndb_filter_has_tag_field(filter, tag))
+		return 0;
+
+	field.type = NDB_FILTER_TAGS;
+	field.elem_type = NDB_ELEMENT_UNKNOWN;
+	field.generic = tag;
+
+	return ndb_filter_start_field_internal(filter, &field);
+}
+
+static int ndb_filter_add_element(struct ndb_filter *filter,
+				  union ndb_filter_element el)
+{
+	// elements are laid out right after the field header, so they can
+	// only be pushed while the field is being built
+	if (!cursor_push(&filter->elem_buf, (unsigned char *)&el, sizeof(el)))
+		return 0;
+
+	filter->current->count++;
+	return 1;
+}
+
+// tag fields can hold either ids or strings, but not both
+static inline int ndb_filter_set_elem_type(struct ndb_filter_elements *els,
+					   enum ndb_generic_element_type type)
+{
+	if (els->field.elem_type == NDB_ELEMENT_UNKNOWN)
+		els->field.elem_type = type;
+
+	return els->field.elem_type == type;
+}
+
+int ndb_filter_add_id_element(struct ndb_filter *filter, const unsigned char *id)
+{
+	union ndb_filter_element el;
+	unsigned char *data;
+	struct ndb_filter_elements *els = filter->current;
+
+	if (!els)
+		return 0;
+
+	switch (els->field.type) {
+	case NDB_FILTER_IDS:
+	case NDB_FILTER_AUTHORS:
+		break;
+	case NDB_FILTER_TAGS:
+		if (!ndb_filter_set_elem_type(els, NDB_ELEMENT_ID))
+			return 0;
+		break;
+	default:
+		return 0;
+	}
+
+	if (!(data = cursor_malloc(&filter->data_buf, 32)))
+		return 0;
+
+	memcpy(data, id, 32);
+	el.id = data;
+
+	return ndb_filter_add_element(filter, el);
+}
+
+int ndb_filter_add_str_element(struct ndb_filter *filter, const char *str)
+{
+	union ndb_filter_element el;
+	unsigned char id[32];
+	struct ndb_filter_elements *els = filter->current;
+
+	if (!els || els->field.type != NDB_FILTER_TAGS)
+		return 0;
+
+	// notes store tag values that look like ids as packed ids, so
+	// match them that way
+	if (strlen(str) == 64 && hex_is_lower(str, 64) &&
+	    hex_decode(str, 64, id, sizeof(id)))
+		return ndb_filter_add_id_element(filter, id);
+
+	if (!ndb_filter_set_elem_type(els, NDB_ELEMENT_STRING))
+		return 0;
+
+	el.string = (const char *)filter->data_buf.p;
+	if (!cursor_push_c_str(&filter->data_buf, str))
+		return 0;
+
+	return ndb_filter_add_element(filter, el);
+}
+
+int ndb_filter_add_int_element(struct ndb_filter *filter, uint64_t integer)
+{
+	union ndb_filter_element el;
+	struct ndb_filter_elements *els = filter->current;
+
+	if (!els)
+		return 0;
+
+	switch (els->field.type) {
+	case NDB_FILTER_KINDS:
+		break;
+	case NDB_FILTER_SINCE:
+	case NDB_FILTER_UNTIL:
+	case NDB_FILTER_LIMIT:
+		// these only have a single value
+		if (els->count != 0)
+			return 0;
+		break;
+	default:
+		return 0;
+	}
+
+	el.integer = integer;
+	return ndb_filter_add_element(filter, el);
+}
+
+void ndb_filter_end_field(struct ndb_filter *filter)
+{
+	if (!filter->current)
+		return;
+
+	filter->elements[filter->num_elements++] = filter->current;
+	filter->current = NULL;
+}
+
+static int ndb_filter_match_id(struct ndb_filter_elements *els,
+			       const unsigned char *id)
+{
+	for (int i = 0; i < els->count; i++) {
+		if (!memcmp(els->elements[i].id, id, 32))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int ndb_filter_match_kind(struct ndb_filter_elements *els,
+				 uint32_t kind)
+{
+	for (int i = 0; i < els->count; i++) {
+		if (els->elements[i].integer == kind)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int ndb_filter_match_tag_value(struct ndb_filter_elements *els,
+				      struct ndb_str value)
+{
+	for (int i = 0; i < els->count; i++) {
+		if (els->field.elem_type == NDB_ELEMENT_ID) {
+			if (value.flag == NDB_PACKED_ID &&
+			    !memcmp(value.id, els->elements[i].id, 32))
+				return 1;
+		} else if (value.flag != NDB_PACKED_ID &&
+			   !strcmp(value.str, els->elements[i].string)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// match the first value of any tag whose key is the field's tag letter
+static int ndb_filter_match_tags(struct ndb_filter_elements *els,
+				 struct ndb_note *note)
+{
+	struct ndb_iterator iter, *it = &iter;
+
+	ndb_tags_iterate_start(note, it);
+
+	while (ndb_tags_iterate_next(it)) {
+		if (it->tag->count < 2)
+			continue;
+
+		if (ndb_tag_key_letter(ndb_iter_tag_str(it, 0)) != els->field.generic)
+			continue;
+
+		if (ndb_filter_match_tag_value(els, ndb_iter_tag_str(it, 1)))
+			return 1;
+	}
+
+	return 0;
+}
+
+int ndb_filter_matches(struct ndb_filter *filter, struct ndb_note *note)
+{
+	struct ndb_filter_elements *els;
+
+	for (int i = 0; i < filter->num_elements; i++) {
+		els = filter->elements[i];
+
+		switch (els->field.type) {
+		case NDB_FILTER_IDS:
+			if (!ndb_filter_match_id(els, note->id))
+				return 0;
+			break;
+		case NDB_FILTER_AUTHORS:
+			if (!ndb_filter_match_id(els, note->pubkey))
+				return 0;
+			break;
+		case NDB_FILTER_KINDS:
+			if (!ndb_filter_match_kind(els, note->kind))
+				return 0;
+			break;
+		case NDB_FILTER_TAGS:
+			if (!ndb_filter_match_tags(els, note))
+				return 0;
+			break;
+		case NDB_FILTER_SINCE:
+			if (els->count && note->created_at < els->elements[0].integer)
+				return 0;
+			break;
+		case NDB_FILTER_UNTIL:
+			if (els->count && note->created_at > els->elements[0].integer)
+				return 0;
+			break;
+		case NDB_FILTER_LIMIT:
+			break;
+		}
+	}
+
+	return 1;
+}
+
+// a bounded min-heap of query results. the oldest result sits at the root so
+// that we can cheaply evict it when something newer comes along.
+struct ndb_query_results {
+	struct ndb_query_result *results;
+	int count;
+	int capacity;
+
+	// open addressed set of the note keys in the heap, a note can be
+	// reached through more than one index entry. note keys start at 1
+	// so 0 marks an empty slot.
+	uint64_t *keys;
+	uint32_t key_mask;
+};
+
+// newest first, note keys break ties so results are stable
+static inline int ndb_query_result_newer(struct ndb_query_result *a,
+					 struct ndb_query_result *b)
+{
+	if (a->note->created_at != b->note->created_at)
+		return a->note->created_at > b->note->created_at;
+	return a->note_key > b->note_key;
+}
+
+static int ndb_query_result_compare(const void *a, const void *b)
+{
+	struct ndb_query_result *ra = (struct ndb_query_result *)a;
+	struct ndb_query_result *rb = (struct ndb_query_result *)b;
+
+	if (ndb_query_result_newer(ra, rb))
+		return -1;
+	if (ndb_query_result_newer(rb, ra))
+		return 1;
+	return 0;
+}
+
+static inline void ndb_query_results_swap(struct ndb_query_results *res,
+					  int i, int j)
+{
+	struct ndb_query_result tmp = res->results[i];
+	res->results[i] = res->results[j];
+	res->results[j] = tmp;
+}
+
+static void ndb_query_results_sift_up(struct ndb_query_results *res, int i)
+{
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!ndb_query_result_newer(&res->results[parent],
+					    &res->results[i]))
+			break;
+		ndb_query_results_swap(res, i, parent);
+		i = parent;
+	}
+}
+
+static void ndb_query_results_sift_down(struct ndb_query_results *res, int i)
+{
+	int left, right, oldest;
+
+	for (;;) {
+		oldest = i;
+		left = 2 * i + 1;
+		right = left + 1;
+
+		if (left < res->count &&
+		    ndb_query_result_newer(&res->results[oldest],
+					   &res->results[left]))
+			oldest = left;
+
+		if (right < res->count &&
+		    ndb_query_result_newer(&res->results[oldest],
+					   &res->results[right]))
+			oldest = right;
+
+		if (oldest == i)
+			return;
+
+		ndb_query_results_swap(res, i, oldest);
+		i = oldest;
+	}
+}
+
+// the set holds at most `capacity` keys, so size it to at least twice that
+static uint32_t ndb_query_results_key_slots(int capacity)
+{
+	uint32_t slots = 16;
+
+	while (slots < (uint32_t)capacity * 2)
+		slots <<= 1;
+
+	return slots;
+}
+
+static void ndb_query_results_init(struct ndb_query_results *res,
+				   struct ndb_query_result *results,
+				   int capacity, uint64_t *keys,
+				   uint32_t key_slots)
+{
+	res->results = results;
+	res->count = 0;
+	res->capacity = capacity;
+	res->keys = keys;
+	res->key_mask = key_slots - 1;
+	memset(keys, 0, sizeof(*keys) * key_slots);
+}
+
+// the slot holding note_key, or the empty slot where it would go
+static inline uint32_t ndb_query_results_key_slot(struct ndb_query_results *res,
+						  uint64_t note_key)
+{
+	uint32_t i = (uint32_t)((note_key * 0x9E3779B97F4A7C15ULL) >> 32) &
+		     res->key_mask;
+
+	while (res->keys[i] && res->keys[i] != note_key)
+		i = (i + 1) & res->key_mask;
+
+	return i;
+}
+
+static void ndb_query_results_remove_key(struct ndb_query_results *res,
+					 uint64_t note_key)
+{
+	uint32_t i, j, home;
+
+	i = ndb_query_results_key_slot(res, note_key);
+	if (!res->keys[i])
+		return;
+
+	// shift back any later key in the run that can't be found past
+	// the hole we're leaving
+	for (j = (i + 1) & res->key_mask; res->keys[j];
+	     j = (j + 1) & res->key_mask) {
+		home = (uint32_t)((res->keys[j] * 0x9E3779B97F4A7C15ULL) >> 32) &
+		       res->key_mask;
+		if (((j - home) & res->key_mask) >= ((j - i) & res->key_mask)) {
+			res->keys[i] = res->keys[j];
+			i = j;
+		}
+	}
+
+	res->keys[i] = 0;
+}
+
+// keep the newest `capacity` distinct results we've seen so far
+static void ndb_query_results_push(struct ndb_query_results *res,
+				   struct ndb_query_result *result)
+{
+	uint32_t slot = ndb_query_results_key_slot(res, result->note_key);
+
+	if (res->keys[slot])
+		return;
+
+	if (res->count < res->capacity) {
+		res->keys[slot] = result->note_key;
+		res->results[res->count] = *result;
+		ndb_query_results_sift_up(res, res->count++);
+		return;
+	}
+
+	if (res->capacity == 0 ||
+	    !ndb_query_result_newer(result, &res->results[0]))
+		return;
+
+	ndb_query_results_remove_key(res, res->results[0].note_key);
+	slot = ndb_query_results_key_slot(res, result->note_key);
+	res->keys[slot] = result->note_key;
+
+	res->results[0] = *result;
+	ndb_query_results_sift_down(res, 0);
+}
+
+static inline void ndb_query_result_init(struct ndb_query_result *res,
+					 MDB_val *note, uint64_t note_key)
+{
+	res->note = note->mv_data;
+	res->note_size = note->mv_size;
+	res->note_key = note_key;
+}
+
+static void ndb_filter_time_bounds(struct ndb_filter *filter,
+				   uint64_t *since, uint64_t *until)
+{
+	struct ndb_filter_elements *els;
+
+	*since = 0;
+	*until = UINT64_MAX;
+
+	if ((els = ndb_filter_get_elements(filter, NDB_FILTER_SINCE)) && els->count)
+		*since = els->elements[0].integer;
+
+	if ((els = ndb_filter_get_elements(filter, NDB_FILTER_UNTIL)) && els->count)
+		*until = els->elements[0].integer;
+}
+
+// Once the heap is full, nothing older than its oldest result can make it
+// in. Index walks are newest first, so they can stop as soon as this is true.
+static inline int ndb_query_results_done(struct ndb_query_results *res,
+					 uint64_t created_at, uint64_t note_key)
+{
+	struct ndb_query_result *oldest;
+
+	if (res->count < res->capacity)
+		return 0;
+
+	if (res->capacity == 0)
+		return 1;
+
+	oldest = &res->results[0];
+	if (created_at != oldest->note->created_at)
+		return created_at < oldest->note->created_at;
+
+	return note_key <= oldest->note_key;
+}
+
+// Walk a created_at-clustered index newest first. Index keys are some prefix
+// followed by the created_at timestamp, values are note keys. `key` is the
+// prefix we're looking for with `until` as its timestamp.
+static int ndb_query_plan_index(MDB_txn *txn, struct ndb_lmdb *lmdb,
+				MDB_cursor *cur, void *key, size_t keylen,
+				struct ndb_filter *filter, uint64_t since,
+				struct ndb_query_results *res)
+{
+	MDB_val k, v, note;
+	uint64_t note_key, created_at;
+	size_t prefix_len = keylen - sizeof(created_at);
+	struct ndb_query_result result;
+
+	k.mv_data = key;
+	k.mv_size = keylen;
+
+	if (!ndb_cursor_seek_last_le(cur, &k, &v))
+		return 1;
+
+	do {
+		// we've walked past the prefix we're interested in
+		if (k.mv_size != keylen || memcmp(k.mv_data, key, prefix_len))
+			break;
+
+		memcpy(&created_at, (unsigned char *)k.mv_data + prefix_len,
+		       sizeof(created_at));
+		note_key = *(uint64_t *)v.mv_data;
+
+		if (created_at < since ||
+		    ndb_query_results_done(res, created_at, note_key))
+			break;
+
+		k.mv_data = &note_key;
+		k.mv_size = sizeof(note_key);
+		if (mdb_get(txn, lmdb->dbs[NDB_DB_NOTE], &k, &note))
+			continue;
+
+		if (!ndb_filter_matches(filter, note.mv_data))
+			continue;
+
+		ndb_query_result_init(&result, &note, note_key);
+		ndb_query_results_push(res, &result);
+	} while (!mdb_cursor_get(cur, &k, &v, MDB_PREV));
+
+	return 1;
+}
+
+// walk each author's notes newest first
+static int ndb_query_plan_authors(MDB_txn *txn, struct ndb_lmdb *lmdb,
+				  struct ndb_filter *filter,
+				  struct ndb_filter_elements *authors,
+				  struct ndb_query_results *res)
+{
+	MDB_cursor *cur;
+	struct ndb_tsid tsid;
+	uint64_t since, until;
+
+	ndb_filter_time_bounds(filter, &since, &until);
+
+	if (mdb_cursor_open(txn, lmdb->dbs[NDB_DB_NOTE_PUBKEY], &cur))
+		return 0;
+
+	for (int i = 0; i < authors->count; i++) {
+		ndb_tsid_init(&tsid, authors->elements[i].id, until);
+		ndb_query_plan_index(txn, lmdb, cur, &tsid, sizeof(tsid),
+				     filter, since, res);
+	}
+
+	mdb_cursor_close(cur);
+	return 1;
+}
+
+// pick the tag field with the fewest values to walk
+static struct ndb_filter_elements *
+ndb_filter_get_tag_elements(struct ndb_filter *filter)
+{
+	struct ndb_filter_elements *els, *best = NULL;
+
+	for (int i = 0; i < filter->num_elements; i++) {
+		els = filter->elements[i];
+		if (els->field.type != NDB_FILTER_TAGS)
+			continue;
+		if (best == NULL || els->count < best->count)
+			best = els;
+	}
+
+	return best;
+}
+
+// walk the notes of each tag value newest first
+static int ndb_query_plan_tags(MDB_txn *txn, struct ndb_lmdb *lmdb,
+			       struct ndb_filter *filter,
+			       struct ndb_filter_elements *tags,
+			       struct ndb_query_results *res)
+{
+	MDB_cursor *cur;
+	unsigned char key[NDB_TAG_KEY_SIZE];
+	union ndb_filter_element *el;
+	uint64_t since, until;
+	int keylen;
+	char letter = tags->field.generic;
+
+	ndb_filter_time_bounds(filter, &since, &until);
+
+	if (mdb_cursor_open(txn, lmdb->dbs[NDB_DB_NOTE_TAGS], &cur))
+		return 0;
+
+	for (int i = 0; i < tags->count; i++) {
+		el = &tags->elements[i];
+		if (tags->field.elem_type == NDB_ELEMENT_ID) {
+			keylen = ndb_tag_key_init(key, letter, NDB_PACKED_ID,
+						  el->id, 32, until);
+		} else {
+			keylen = ndb_tag_key_init(key, letter, NDB_PACKED_STR,
+						  el->string, strlen(el->string),
+						  until);
+		}
+
+		ndb_query_plan_index(txn, lmdb, cur, key, keylen, filter,
+				     since, res);
+	}
+
+	mdb_cursor_close(cur);
+	return 1;
+}
+
+// walk each kind's notes newest first
+static int ndb_query_plan_kinds(MDB_txn *txn, struct ndb_lmdb *lmdb,
+				struct ndb_filter *filter,
+				struct ndb_filter_elements *kinds,
+				struct ndb_query_results *res)
+{
+	MDB_cursor *cur;
+	struct ndb_u64_tsid key;
+	uint64_t since, until;
+
+	ndb_filter_time_bounds(filter, &since, &until);
+
+	if (mdb_cursor_open(txn, lmdb->dbs[NDB_DB_NOTE_KIND], &cur))
+		return 0;
+
+	for (int i = 0; i < kinds->count; i++) {
+		ndb_u64_tsid_init(&key, kinds->elements[i].integer, until);
+		ndb_query_plan_index(txn, lmdb, cur, &key, sizeof(key),
+				     filter, since, res);
+	}
+
+	mdb_cursor_close(cur);
+	return 1;
+}
+
+// look up each id in the note_id index and check the rest of the filter
+static int ndb_query_plan_ids(MDB_txn *txn, struct ndb_lmdb *lmdb,
+			      struct ndb_filter *filter,
+			      struct ndb_filter_elements *ids,
+			      struct ndb_query_results *res)
+{
+	MDB_val k, v;
+	uint64_t note_key;
+	struct ndb_query_result result;
+
+	for (int i = 0; i < ids->count; i++) {
+		if (!ndb_get_tsid(txn, lmdb, NDB_DB_NOTE_ID, ids->elements[i].id, &k))
+			continue;
+
+		note_key = *(uint64_t *)k.mv_data;
+		if (mdb_get(txn, lmdb->dbs[NDB_DB_NOTE], &k, &v))
+			continue;
+
+		if (!ndb_filter_matches(filter, v.mv_data))
+			continue;
+
+		ndb_query_result_init(&result, &v, note_key);
+		ndb_query_results_push(res, &result);
+	}
+
+	return 1;
+}
+
+// no usable index, walk the created_at timeline between since and until
+static int ndb_query_plan_created_at(MDB_txn *txn, struct ndb_lmdb *lmdb,
+				     struct ndb_filter *filter,
+				     struct ndb_query_results *res)
+{
+	MDB_cursor *cur;
+	uint64_t since, until;
+
+	ndb_filter_time_bounds(filter, &since, &until);
+
+	if (mdb_cursor_open(txn, lmdb->dbs[NDB_DB_NOTE_CREATED_AT], &cur))
+		return 0;
+
+	ndb_query_plan_index(txn, lmdb, cur, &until, sizeof(until), filter,
+			     since, res);
+
+	mdb_cursor_close(cur);
+	return 1;
+}
+
+static int ndb_query_filter(MDB_txn *txn, struct ndb_lmdb *lmdb,
+			    struct ndb_filter *filter,
+			    struct ndb_query_results *res)
+{
+	struct ndb_filter_elements *els;
+
+	if ((els = ndb_filter_get_elements(filter, NDB_FILTER_IDS)))
+		return ndb_query_plan_ids(txn, lmdb, filter, els, res);
+
+	if ((els = ndb_filter_get_elements(filter, NDB_FILTER_AUTHORS)))
+		return ndb_query_plan_authors(txn, lmdb, filter, els, res);
+
+	if ((els = ndb_filter_get_tag_elements(filter)))
+		return ndb_query_plan_tags(txn, lmdb, filter, els, res);
+
+	if ((els = ndb_filter_get_elements(filter, NDB_FILTER_KINDS)))
+		return ndb_query_plan_kinds(txn, lmdb, filter, els, res);
+
+	return ndb_query_plan_created_at(txn, lmdb, filter, res);
+}
+
+// Query notes matching any of the given filters. Results are written newest
+// first. Each filter's limit applies to that filter, result_capacity caps
+// the total. Results are valid until the txn ends.
+int ndb_query(struct ndb_txn *txn, struct ndb_filter *filters, int num_filters,
+	      struct ndb_query_result *results, int result_capacity, int *count)
+{
+	struct ndb_query_results all, res;
+	struct ndb_query_result *scratch;
+	struct ndb_filter_elements *limit;
+	uint64_t *keys;
+	uint32_t key_slots;
+	int i, j, capacity, ok = 0;
+
+	*count = 0;
+
+	if (result_capacity <= 0)
+		return 1;
+
+	// each filter gets its own heap so its limit is honored on its own
+	key_slots = ndb_query_results_key_slots(result_capacity);
+	if (!(scratch = malloc(sizeof(*scratch) * result_capacity +
+			       sizeof(*keys) * key_slots * 2)))
+		return 0;
+	keys = (uint64_t *)(scratch + result_capacity);
+
+	ndb_query_results_init(&all, results, result_capacity, keys, key_slots);
+
+	for (i = 0; i < num_filters; i++) {
+		capacity = result_capacity;
+		limit = ndb_filter_get_elements(&filters[i], NDB_FILTER_LIMIT);
+		if (limit && limit->count &&
+		    limit->elements[0].integer < (uint64_t)result_capacity)
+			capacity = limit->elements[0].integer;
+
+		ndb_query_results_init(&res, scratch, capacity,
+				       keys + key_slots, key_slots);
+
+		if (!ndb_query_filter(txn->mdb_txn, &txn->ndb->lmdb, &filters[i], &res))
+			goto cleanup;
+
+		for (j = 0; j < res.count; j++)
+			ndb_query_results_push(&all, &scratch[j]);
+	}
+
+	qsort(results, all.count, sizeof(*results), ndb_query_result_compare);
+	*count = all.count;
+	ok = 1;
+
+cleanup:
+	free(scratch);
+	return ok;
+}
+
 static enum ndb_idres ndb_ingester_json_controller(void *data, const char *hexid)
 {
 	unsigned char id[32];
@@ -372,9 +2215,15 @@ static enum ndb_idres ndb_ingester_json_controller(void *data, const char *hexid
 
 	hex_decode(hexid, 64, id, sizeof(id));
 
-	// let's see if we already have it
+	// most ids are ones we've never seen, the filter tells us that
+	// without touching the db
+	if (!ndb_id_filter_maybe_has(c->ids, id))
+		return NDB_IDRES_CONT;
+
+	// let's see if we already have it. without a read txn we let the
+	// writer find out
 
-	if (!ndb_has_note(c->read_txn, c->lmdb, id))
+	if (!c->read_txn || !ndb_has_note(c->read_txn, c->lmdb, id))
 		return NDB_IDRES_CONT;
 
 	return NDB_IDRES_STOP;
@@ -454,41 +2303,139 @@ static int ndb_process_profile_note(struct ndb_note *note,
 	flatcc_builder_ref_t lnurl_off;
 	lnurl_off = flatcc_builder_create_string_str(builder, lnurl);
 
-	NdbProfileRecord_lnurl_add(builder, lnurl_off);
+	NdbProfileRecord_lnurl_add(builder, lnurl_off);
+
+	//*profile = flatcc_builder_finalize_aligned_buffer(builder, profile_len);
+	return 1;
+}
+
+
+static struct ndb_note_chunk *ndb_note_chunk_new(size_t size)
+{
+	struct ndb_note_chunk *chunk;
+
+	if (!(chunk = malloc(sizeof(*chunk) + size)))
+		return NULL;
+
+	// the arena's reference
+	chunk->refs = 1;
+	chunk->size = size;
+	chunk->used = 0;
+
+	return chunk;
+}
+
+// drop a reference, called by the writer after commit and by the ingester
+// when it moves on to a new chunk
+static void ndb_note_chunk_release(struct ndb_note_chunk *chunk)
+{
+	if (__atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(chunk);
+}
+
+// Get `size` bytes of scratch space to build a note in. Nothing is kept
+// until ndb_note_arena_keep.
+static unsigned char *ndb_note_arena_reserve(struct ndb_note_arena *arena,
+					     size_t size)
+{
+	struct ndb_note_chunk *chunk = arena->chunk;
+
+	if (chunk && chunk->size - chunk->used >= size)
+		return chunk->data + chunk->used;
+
+	if (chunk)
+		ndb_note_chunk_release(chunk);
+
+	// huge notes get a chunk of their own
+	arena->chunk = ndb_note_chunk_new(max(size, NOTE_CHUNK_SIZE));
+	return arena->chunk ? arena->chunk->data : NULL;
+}
+
+// keep the first `size` bytes of the reserved space. the caller gets a
+// reference on the chunk
+static struct ndb_note_chunk *ndb_note_arena_keep(struct ndb_note_arena *arena,
+						  size_t size)
+{
+	struct ndb_note_chunk *chunk = arena->chunk;
+
+	// keep notes 8-byte aligned
+	chunk->used += (size + 7) & ~7;
+	__atomic_add_fetch(&chunk->refs, 1, __ATOMIC_RELAXED);
+
+	return chunk;
+}
+
+static void ndb_note_arena_destroy(struct ndb_note_arena *arena)
+{
+	if (arena->chunk)
+		ndb_note_chunk_release(arena->chunk);
+	arena->chunk = NULL;
+}
+
+static void ndb_writer_note_free(struct ndb_writer *writer,
+				 struct ndb_writer_note *note)
+{
+	ndb_inflight_clear(&writer->inflight, note->inflight);
 
-	//*profile = flatcc_builder_finalize_aligned_buffer(builder, profile_len);
-	return 1;
+	if (note->chunk)
+		ndb_note_chunk_release(note->chunk);
+	else
+		free(note->note);
+}
+
+// release everything a writer message holds. this is either after commit,
+// or when the message never made it to the writer
+static void ndb_writer_msg_free(struct ndb_writer *writer,
+				struct ndb_writer_msg *msg)
+{
+	if (msg->type == NDB_WRITER_NOTE) {
+		ndb_writer_note_free(writer, &msg->note);
+	} else if (msg->type == NDB_WRITER_PROFILE) {
+		ndb_writer_note_free(writer, &msg->profile.note);
+		ndb_profile_record_builder_free(&msg->profile.record);
+	}
 }
 
+static void ndb_ingester_event_release(struct ndb_ingester_event *ev)
+{
+	if (ev->release)
+		ev->release(ev->release_ctx, ev->json, ev->len);
+	else
+		free((char *)ev->json);
+}
 
-static int ndb_ingester_process_event(secp256k1_context *ctx,
-				      struct ndb_ingester *ingester,
+static int ndb_ingester_process_event(struct ndb_ingester *ingester,
 				      struct ndb_ingester_event *ev,
 				      struct ndb_writer_msg *out,
-				      MDB_txn *read_txn
+				      MDB_txn *read_txn,
+				      struct ndb_note_arena *arena
 				      )
 {
 	struct ndb_tce tce;
 	struct ndb_note *note;
+	struct ndb_note_chunk *chunk;
 	struct ndb_ingest_controller controller;
 	struct ndb_id_cb cb;
+	struct ndb_inflight *inflight;
 	void *buf;
 	size_t bufsize, note_size;
+	int slot;
 
 	// we will use this to check if we already have it in the DB during
 	// ID parsing
 	controller.read_txn = read_txn;
 	controller.lmdb = ingester->writer->lmdb;
+	controller.ids = &ingester->writer->ids;
 	cb.fn = ndb_ingester_json_controller;
 	cb.data = &controller;
 
-	// since we're going to be passing this allocated note to a different
-	// thread, we can't use thread-local buffers. just allocate a block
+	// we're passing the note to the writer thread, so it's built in
+	// our arena which the writer releases after commit
         bufsize = max(ev->len * 8.0, 4096);
-	buf = malloc(bufsize);
+	buf = ndb_note_arena_reserve(arena, bufsize);
 	if (!buf) {
 		ndb_debug("couldn't malloc buf\n");
-		return 0;
+		goto cleanup;
 	}
 
 	note_size =
@@ -511,50 +2458,91 @@ static int ndb_ingester_process_event(secp256k1_context *ctx,
 	case NDB_TCE_OK:     goto cleanup;
 	case NDB_TCE_EVENT:
 		note = tce.event.note;
-		if (note != buf) {
-			ndb_debug("note buffer not equal to malloc'd buffer\n");
+		if ((void *)note != buf) {
+			ndb_debug("note buffer not equal to arena buffer\n");
 			goto cleanup;
 		}
 
-		// Verify! If it's an invalid note we don't need to
-		// bothter writing it to the database
-		if (!ndb_note_verify(ctx, note->pubkey, note->id, note->sig)) {
-			ndb_debug("signature verification failed\n");
+		// the signature only covers the claimed id, so make sure
+		// it actually is the id of this note. This is checked
+		// before claiming so a forged copy can't hold the claim.
+		if (!ndb_note_verify_id(note)) {
+			ndb_debug("id verification failed\n");
 			goto cleanup;
 		}
 
-		// we didn't find anything. let's send it
-		// to the writer thread
-		note = realloc(note, note_size);
-		assert(((uint64_t)note % 4) == 0);
-
-		if (note->kind == 0) {
-			struct ndb_profile_record_builder *b = 
-				&out->profile.record;
+		// another ingester is already verifying this exact note
+		inflight = &ingester->writer->inflight;
+		if (!ndb_inflight_claim(inflight, note->id, note->sig, &slot))
+			goto cleanup;
 
-			ndb_process_profile_note(note, b);
+		// we didn't find anything. keep it around until the
+		// whole batch has been verified in
+		// ndb_ingester_verify_batch
+		chunk = ndb_note_arena_keep(arena, note_size);
+		assert(((uint64_t)note % 4) == 0);
 
-			out->type = NDB_WRITER_PROFILE;
-			out->profile.note.note = note;
-			out->profile.note.note_len = note_size;
-		} else {
-			out->type = NDB_WRITER_NOTE;
-			out->note.note = note;
-			out->note.note_len = note_size;
-		}
+		out->type = NDB_WRITER_NOTE;
+		out->note.note = note;
+		out->note.note_len = note_size;
+		out->note.chunk = chunk;
+		out->note.inflight = slot;
 
 		// there's nothing left to do with the original json, so free it
-		free(ev->json);
+		ndb_ingester_event_release(ev);
 		return 1;
 	}
 
 cleanup:
-	free(ev->json);
-	free(buf);
+	ndb_ingester_event_release(ev);
 
 	return 0;
 }
 
+// Verify the signatures of the notes process_event handed us. Invalid
+// notes are dropped and the rest are compacted to the front of `outs`
+// for the writer. Returns how many are left.
+static int ndb_ingester_verify_batch(secp256k1_context *ctx,
+				     struct ndb_ingester *ingester,
+				     struct ndb_writer_msg *outs, int n)
+{
+	struct ndb_note *notes[THREAD_QUEUE_BATCH];
+	unsigned char ok[THREAD_QUEUE_BATCH];
+	struct ndb_writer_note wnote;
+	struct ndb_writer_msg *out;
+	int i, valid;
+
+	for (i = 0; i < n; i++)
+		notes[i] = outs[i].note.note;
+
+	ndb_note_verify_many(ctx, notes, n, ok);
+
+	for (i = 0, valid = 0; i < n; i++) {
+		// If it's an invalid note we don't need to bother writing
+		// it to the database
+		if (!ok[i]) {
+			ndb_debug("signature verification failed\n");
+			ndb_writer_msg_free(ingester->writer, &outs[i]);
+			continue;
+		}
+
+		out = &outs[valid++];
+		wnote = outs[i].note;
+
+		if (wnote.note->kind == 0) {
+			ndb_process_profile_note(wnote.note,
+						 &out->profile.record);
+			out->type = NDB_WRITER_PROFILE;
+			out->profile.note = wnote;
+		} else {
+			out->type = NDB_WRITER_NOTE;
+			out->note = wnote;
+		}
+	}
+
+	return valid;
+}
+
 static uint64_t ndb_get_last_key(MDB_txn *txn, MDB_dbi db)
 {
 	MDB_cursor *mc;
@@ -640,12 +2628,50 @@ static int ndb_write_profile(struct ndb_lmdb *lmdb, MDB_txn *txn,
 	return 1;
 }
 
+// index the first value of every single-letter tag
+static int ndb_write_note_tags(struct ndb_lmdb *lmdb, MDB_txn *txn,
+			       struct ndb_note *note, uint64_t note_key)
+{
+	int rc;
+	char letter;
+	unsigned char buf[NDB_TAG_KEY_SIZE];
+	struct ndb_iterator iter, *it = &iter;
+	MDB_val key, val;
+
+	val.mv_data = &note_key;
+	val.mv_size = sizeof(note_key);
+	key.mv_data = buf;
+
+	ndb_tags_iterate_start(note, it);
+
+	while (ndb_tags_iterate_next(it)) {
+		if (it->tag->count < 2)
+			continue;
+
+		if (!(letter = ndb_tag_key_letter(ndb_iter_tag_str(it, 0))))
+			continue;
+
+		key.mv_size = ndb_tag_key_from_str(buf, letter,
+						   ndb_iter_tag_str(it, 1),
+						   note->created_at);
+
+		if ((rc = mdb_put(txn, lmdb->dbs[NDB_DB_NOTE_TAGS], &key, &val, 0))) {
+			ndb_debug("write note tag index to db failed: %s\n",
+					mdb_strerror(rc));
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
 static uint64_t ndb_write_note(struct ndb_lmdb *lmdb, MDB_txn *txn,
 			       struct ndb_writer_note *note)
 {
 	int rc;
 	uint64_t note_key;
 	struct ndb_tsid tsid;
+	struct ndb_u64_tsid kind_key;
 	MDB_dbi note_db, id_db;
 	MDB_val key, val;
 	
@@ -681,20 +2707,67 @@ static uint64_t ndb_write_note(struct ndb_lmdb *lmdb, MDB_txn *txn,
 		return 0;
 	}
 
+	// write pubkey index key clustered with created_at
+	ndb_tsid_init(&tsid, note->note->pubkey, note->note->created_at);
+
+	if ((rc = mdb_put(txn, lmdb->dbs[NDB_DB_NOTE_PUBKEY], &key, &val, 0))) {
+		ndb_debug("write note pubkey index to db failed: %s\n",
+				mdb_strerror(rc));
+		return 0;
+	}
+
+	// write kind index key clustered with created_at
+	ndb_u64_tsid_init(&kind_key, note->note->kind, note->note->created_at);
+	key.mv_data = &kind_key;
+	key.mv_size = sizeof(kind_key);
+
+	if ((rc = mdb_put(txn, lmdb->dbs[NDB_DB_NOTE_KIND], &key, &val, 0))) {
+		ndb_debug("write note kind index to db failed: %s\n",
+				mdb_strerror(rc));
+		return 0;
+	}
+
+	if (!ndb_write_note_tags(lmdb, txn, note->note, note_key))
+		return 0;
+
+	// write to the global created_at timeline
+	key.mv_data = &note->note->created_at;
+	key.mv_size = sizeof(note->note->created_at);
+
+	if ((rc = mdb_put(txn, lmdb->dbs[NDB_DB_NOTE_CREATED_AT], &key, &val, 0))) {
+		ndb_debug("write note created_at index to db failed: %s\n",
+				mdb_strerror(rc));
+		return 0;
+	}
+
 	return note_key;
 }
 
+// Ingesters only drop copies they can see in their snapshot or in the
+// inflight set, a copy can get past both while the first one is being
+// committed. We have the final say, this sees our own uncommitted writes too.
+static int ndb_writer_has_note(struct ndb_writer *writer, MDB_txn *txn,
+			       struct ndb_note *note)
+{
+	if (!ndb_id_filter_maybe_has(&writer->ids, note->id))
+		return 0;
+
+	return ndb_has_note(txn, writer->lmdb, note->id);
+}
+
 static void *ndb_writer_thread(void *data)
 {
 	struct ndb_writer *writer = data;
 	struct ndb_writer_msg msgs[THREAD_QUEUE_BATCH], *msg;
-	int i, popped, done, any_note;
+	struct ndb_monitor_msg written[THREAD_QUEUE_BATCH];
+	int i, popped, done, any_note, num_written;
 	uint64_t note_nkey;
 	MDB_txn *txn;
 
 	done = 0;
 	while (!done) {
 		txn = NULL;
+		num_written = 0;
 		popped = prot_queue_pop_all(&writer->inbox, msgs, THREAD_QUEUE_BATCH);
 		//ndb_debug("writer popped %d items\n", popped);
 
@@ -718,6 +2791,13 @@ static void *ndb_writer_thread(void *data)
 
 		for (i = 0; i < popped; i++) {
 			msg = &msgs[i];
+			note_nkey = 0;
+
+			if (msg->type != NDB_WRITER_QUIT &&
+			    ndb_writer_has_note(writer, txn, msg->note.note)) {
+				ndb_debug("writer: skipping duplicate note\n");
+				continue;
+			}
 
 			switch (msg->type) {
 			case NDB_WRITER_QUIT:
@@ -735,9 +2815,20 @@ static void *ndb_writer_thread(void *data)
 				}
 				break;
 			case NDB_WRITER_NOTE:
-				ndb_write_note(writer->lmdb, txn, &msg->note);
+				note_nkey =
+					ndb_write_note(writer->lmdb, txn, &msg->note);
 				break;
 			}
+
+			if (note_nkey) {
+				// before commit, so ingesters can't see the
+				// note in the db without it being in here
+				ndb_id_filter_add(&writer->ids,
+						  msg->note.note->id);
+
+				written[num_written].type = NDB_MONITOR_NOTE;
+				written[num_written++].note_key = note_nkey;
+			}
 		}
 
 		// commit writes
@@ -746,17 +2837,21 @@ static void *ndb_writer_thread(void *data)
 			assert(false);
 		}
 
-
-		// free notes
-		for (i = 0; i < popped; i++) {
-			msg = &msgs[i];
-			if (msg->type == NDB_WRITER_NOTE)
-				free(msg->note.note);
-			else if (msg->type == NDB_WRITER_PROFILE) {
-				free(msg->profile.note.note);
-				ndb_profile_record_builder_free(&msg->profile.record);
-			}
+		// let subscribers know. we never block on the monitor, if it
+		// falls this far behind we drop notifications
+		if (num_written > 0 &&
+		    !prot_queue_push_all(&writer->monitor->inbox, written,
+					 num_written)) {
+			ndb_debug("monitor queue full, dropped %d notes\n",
+				  num_written);
 		}
+
+
+		// free notes. copies that come in from here on will find
+		// them in the db instead of the inflight set, or we'll skip
+		// them above
+		for (i = 0; i < popped; i++)
+			ndb_writer_msg_free(writer, &msgs[i]);
 	}
 
 	ndb_debug("quitting writer thread\n");
@@ -771,68 +2866,585 @@ static void *ndb_ingester_thread(void *data)
 	struct ndb_lmdb *lmdb = ingester->writer->lmdb;
 	struct ndb_ingester_msg msgs[THREAD_QUEUE_BATCH], *msg;
 	struct ndb_writer_msg outs[THREAD_QUEUE_BATCH], *out;
-	int i, to_write, popped, done, any_event;
-	MDB_txn *read_txn = NULL;
+	struct ndb_note_arena arena = { .chunk = NULL };
+	int i, to_write, popped, done, any_event, rc;
+	MDB_txn *read_txn = NULL, *batch_txn;
 
 	ctx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
 	ndb_debug("started ingester thread\n");
 
 	done = 0;
 	while (!done) {
-		to_write = 0;
-		any_event = 0;
+		to_write = 0;
+		any_event = 0;
+
+		popped = prot_queue_pop_all(&thread->inbox, msgs, THREAD_QUEUE_BATCH);
+		//ndb_debug("ingester popped %d items\n", popped);
+
+		for (i = 0; i < popped; i++) {
+			msg = &msgs[i];
+			if (msg->type == NDB_INGEST_EVENT) {
+				any_event = 1;
+				break;
+			}
+		}
+
+		// keep our read txn (and its reader slot) around between
+		// batches, we just reset and renew it
+		batch_txn = NULL;
+		if (any_event) {
+			if (read_txn == NULL)
+				rc = mdb_txn_begin(lmdb->env, NULL, MDB_RDONLY, &read_txn);
+			else
+				rc = mdb_txn_renew(read_txn);
+
+			if (rc) {
+				// skip the duplicate checks,
+				// ndb_writer_has_note still keeps copies
+				// we let through out of the db
+				ndb_debug("ingester: read txn failed: %s\n", mdb_strerror(rc));
+			} else {
+				batch_txn = read_txn;
+			}
+		}
+
+		for (i = 0; i < popped; i++) {
+			msg = &msgs[i];
+			switch (msg->type) {
+			case NDB_INGEST_QUIT:
+				done = 1;
+				break;
+
+			case NDB_INGEST_EVENT:
+				out = &outs[to_write];
+				if (ndb_ingester_process_event(ingester,
+							       &msg->event, out,
+							       batch_txn, &arena)) {
+					to_write++;
+				}
+			}
+		}
+
+		if (batch_txn)
+			mdb_txn_reset(batch_txn);
+
+		if (to_write > 0)
+			to_write = ndb_ingester_verify_batch(ctx, ingester,
+							     outs, to_write);
+
+		if (to_write > 0) {
+			//ndb_debug("pushing %d events to write queue\n", to_write); 
+			if (!ndb_writer_queue_msgs(ingester->writer, outs, to_write)) {
+				ndb_debug("failed pushing %d events to write queue\n", to_write); 
+				for (i = 0; i < to_write; i++)
+					ndb_writer_msg_free(ingester->writer,
+							    &outs[i]);
+			}
+		}
+	}
+
+	ndb_debug("quitting ingester thread\n");
+	// the writer may still hold references to our last chunk
+	ndb_note_arena_destroy(&arena);
+	if (read_txn)
+		mdb_txn_abort(read_txn);
+	secp256k1_context_destroy(ctx);
+	return NULL;
+}
+
+
+static struct ndb_subscription *
+ndb_monitor_find_subscription(struct ndb_monitor *monitor, uint64_t subid,
+			      int *index)
+{
+	for (int i = 0; i < monitor->num_subscriptions; i++) {
+		if (monitor->subscriptions[i]->subid == subid) {
+			if (index)
+				*index = i;
+			return monitor->subscriptions[i];
+		}
+	}
+
+	return NULL;
+}
+
+// FNV-1a over a field type, tag letter and value
+static uint64_t ndb_sub_hash(enum ndb_filter_fieldtype type, char tag,
+			     const void *data, int len)
+{
+	const unsigned char *p = data;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	h = (h ^ (unsigned char)type) * 0x100000001b3ULL;
+	h = (h ^ (unsigned char)tag) * 0x100000001b3ULL;
+	for (int i = 0; i < len; i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+
+	return h;
+}
+
+static uint64_t ndb_sub_element_hash(struct ndb_filter_elements *els,
+				     union ndb_filter_element *el)
+{
+	switch (els->field.type) {
+	case NDB_FILTER_IDS:
+	case NDB_FILTER_AUTHORS:
+		return ndb_sub_hash(els->field.type, 0, el->id, 32);
+	case NDB_FILTER_KINDS:
+		return ndb_sub_hash(els->field.type, 0, &el->integer,
+				    sizeof(el->integer));
+	case NDB_FILTER_TAGS:
+		if (els->field.elem_type == NDB_ELEMENT_ID)
+			return ndb_sub_hash(els->field.type, els->field.generic,
+					    el->id, 32);
+		return ndb_sub_hash(els->field.type, els->field.generic,
+				    el->string, strlen(el->string));
+	default:
+		return 0;
+	}
+}
+
+static int ndb_sub_index_init(struct ndb_sub_index *index)
+{
+	index->num_buckets = 256;
+	index->count = 0;
+	index->unindexed = NULL;
+	index->buckets = calloc(index->num_buckets, sizeof(*index->buckets));
+	return index->buckets != NULL;
+}
+
+static void ndb_sub_index_grow(struct ndb_sub_index *index)
+{
+	struct ndb_sub_entry **buckets, *entry, *next;
+	int i, num_buckets = index->num_buckets * 2;
+
+	// we can keep going with longer chains if this fails
+	if (!(buckets = calloc(num_buckets, sizeof(*buckets))))
+		return;
+
+	for (i = 0; i < index->num_buckets; i++) {
+		for (entry = index->buckets[i]; entry; entry = next) {
+			next = entry->next;
+			entry->next = buckets[entry->hash & (num_buckets - 1)];
+			buckets[entry->hash & (num_buckets - 1)] = entry;
+		}
+	}
+
+	free(index->buckets);
+	index->buckets = buckets;
+	index->num_buckets = num_buckets;
+}
+
+static int ndb_sub_index_add(struct ndb_sub_index *index,
+			     struct ndb_subscription *sub,
+			     struct ndb_filter *filter, int indexed,
+			     uint64_t hash)
+{
+	struct ndb_sub_entry *entry, **head;
+
+	if (!(entry = malloc(sizeof(*entry))))
+		return 0;
+
+	entry->hash = hash;
+	entry->sub = sub;
+	entry->filter = filter;
+
+	if (!indexed) {
+		head = &index->unindexed;
+	} else {
+		if (index->count >= index->num_buckets * 2)
+			ndb_sub_index_grow(index);
+		head = &index->buckets[hash & (index->num_buckets - 1)];
+		index->count++;
+	}
+
+	entry->next = *head;
+	*head = entry;
+	return 1;
+}
+
+static void ndb_sub_index_remove_chain(struct ndb_sub_entry **head,
+				       struct ndb_subscription *sub,
+				       int *count)
+{
+	struct ndb_sub_entry *entry;
+
+	while ((entry = *head)) {
+		if (entry->sub != sub) {
+			head = &entry->next;
+			continue;
+		}
+
+		*head = entry->next;
+		free(entry);
+		if (count)
+			(*count)--;
+	}
+}
+
+static void ndb_sub_index_remove(struct ndb_sub_index *index,
+				 struct ndb_subscription *sub)
+{
+	for (int i = 0; i < index->num_buckets; i++)
+		ndb_sub_index_remove_chain(&index->buckets[i], sub, &index->count);
+
+	ndb_sub_index_remove_chain(&index->unindexed, sub, NULL);
+}
+
+static void ndb_sub_index_destroy(struct ndb_sub_index *index)
+{
+	struct ndb_sub_entry *entry, *next;
+
+	for (int i = 0; i < index->num_buckets; i++) {
+		for (entry = index->buckets[i]; entry; entry = next) {
+			next = entry->next;
+			free(entry);
+		}
+	}
+
+	for (entry = index->unindexed; entry; entry = next) {
+		next = entry->next;
+		free(entry);
+	}
+
+	free(index->buckets);
+}
+
+// index a filter under each value of its most selective field, in the same
+// order the query planner picks indexes
+static int ndb_sub_index_filter(struct ndb_sub_index *index,
+				struct ndb_subscription *sub,
+				struct ndb_filter *filter)
+{
+	struct ndb_filter_elements *els;
+
+	if (!(els = ndb_filter_get_elements(filter, NDB_FILTER_IDS)) &&
+	    !(els = ndb_filter_get_elements(filter, NDB_FILTER_AUTHORS)) &&
+	    !(els = ndb_filter_get_tag_elements(filter)) &&
+	    !(els = ndb_filter_get_elements(filter, NDB_FILTER_KINDS)))
+		return ndb_sub_index_add(index, sub, filter, 0, 0);
+
+	for (int i = 0; i < els->count; i++) {
+		if (!ndb_sub_index_add(index, sub, filter, 1,
+				ndb_sub_element_hash(els, &els->elements[i])))
+			return 0;
+	}
+
+	return 1;
+}
+
+static void ndb_monitor_wake(struct ndb_monitor *monitor,
+			     struct ndb_subscription *sub)
+{
+	uint64_t *woken;
+	int cap;
+
+	if (sub->woken_batch == monitor->batch)
+		return;
+	sub->woken_batch = monitor->batch;
+
+	if (monitor->num_woken == monitor->woken_cap) {
+		cap = monitor->woken_cap ? monitor->woken_cap * 2 : 64;
+		if (!(woken = realloc(monitor->woken, sizeof(*woken) * cap)))
+			return;
+		monitor->woken = woken;
+		monitor->woken_cap = cap;
+	}
+
+	monitor->woken[monitor->num_woken++] = sub->subid;
+}
+
+static void ndb_monitor_check(struct ndb_monitor *monitor,
+			      struct ndb_sub_entry *entry, uint64_t hash,
+			      int indexed, struct ndb_note *note,
+			      uint64_t note_key)
+{
+	struct ndb_subscription *sub;
+
+	for (; entry; entry = entry->next) {
+		sub = entry->sub;
+
+		if ((indexed && entry->hash != hash) ||
+		    sub->last_note_key == note_key ||
+		    !ndb_filter_matches(entry->filter, note))
+			continue;
+
+		sub->last_note_key = note_key;
+
+		if (!prot_queue_push(&sub->inbox, &note_key)) {
+			ndb_debug("subscription %" PRIu64 " queue full\n",
+				  sub->subid);
+			continue;
+		}
+
+		ndb_monitor_wake(monitor, sub);
+	}
+}
+
+static void ndb_monitor_lookup(struct ndb_monitor *monitor, uint64_t hash,
+			       struct ndb_note *note, uint64_t note_key)
+{
+	struct ndb_sub_index *index = &monitor->index;
+	struct ndb_sub_entry *chain;
+
+	chain = index->buckets[hash & (index->num_buckets - 1)];
+	ndb_monitor_check(monitor, chain, hash, 1, note, note_key);
+}
+
+// Only evaluate the filters indexed under one of the note's id, pubkey,
+// kind or tag values, plus the unindexed ones.
+static void ndb_monitor_dispatch(struct ndb_monitor *monitor,
+				 struct ndb_note *note, uint64_t note_key)
+{
+	struct ndb_iterator iter, *it = &iter;
+	struct ndb_str value;
+	uint64_t kind = note->kind;
+	char letter;
+
+	ndb_monitor_lookup(monitor,
+			   ndb_sub_hash(NDB_FILTER_IDS, 0, note->id, 32),
+			   note, note_key);
+	ndb_monitor_lookup(monitor,
+			   ndb_sub_hash(NDB_FILTER_AUTHORS, 0, note->pubkey, 32),
+			   note, note_key);
+	ndb_monitor_lookup(monitor,
+			   ndb_sub_hash(NDB_FILTER_KINDS, 0, &kind, sizeof(kind)),
+			   note, note_key);
+
+	ndb_tags_iterate_start(note, it);
+	while (ndb_tags_iterate_next(it)) {
+		if (it->tag->count < 2)
+			continue;
+
+		if (!(letter = ndb_tag_key_letter(ndb_iter_tag_str(it, 0))))
+			continue;
+
+		value = ndb_iter_tag_str(it, 1);
+		if (value.flag == NDB_PACKED_ID) {
+			ndb_monitor_lookup(monitor,
+				ndb_sub_hash(NDB_FILTER_TAGS, letter, value.id, 32),
+				note, note_key);
+		} else {
+			ndb_monitor_lookup(monitor,
+				ndb_sub_hash(NDB_FILTER_TAGS, letter, value.str,
+					     strlen(value.str)),
+				note, note_key);
+		}
+	}
+
+	ndb_monitor_check(monitor, monitor->index.unindexed, 0, 0, note,
+			  note_key);
+}
+
+static void *ndb_monitor_thread(void *data)
+{
+	struct ndb_monitor *monitor = data;
+	struct ndb_monitor_msg msgs[THREAD_QUEUE_BATCH], *msg;
+	int i, popped, done, rc;
+	ndb_sub_fn callback;
+	void *callback_ctx;
+	MDB_txn *txn = NULL;
+	MDB_val k, v;
+
+	done = 0;
+	while (!done) {
+		popped = prot_queue_pop_all(&monitor->inbox, msgs, THREAD_QUEUE_BATCH);
 
-		popped = prot_queue_pop_all(&thread->inbox, msgs, THREAD_QUEUE_BATCH);
-		//ndb_debug("ingester popped %d items\n", popped);
+		if (txn == NULL)
+			rc = mdb_txn_begin(monitor->lmdb->env, NULL, MDB_RDONLY, &txn);
+		else
+			rc = mdb_txn_renew(txn);
 
-		for (i = 0; i < popped; i++) {
-			msg = &msgs[i];
-			if (msg->type == NDB_INGEST_EVENT) {
-				any_event = 1;
-				break;
+		// keep draining the queue so nothing blocks pushing to it,
+		// subscribers just miss these notes
+		if (rc) {
+			fprintf(stderr, "monitor thread read txn failed: %s\n",
+				mdb_strerror(rc));
+			for (i = 0; i < popped; i++) {
+				if (msgs[i].type == NDB_MONITOR_QUIT)
+					done = 1;
 			}
+			continue;
 		}
 
-		if (any_event)
-			mdb_txn_begin(lmdb->env, NULL, MDB_RDONLY, &read_txn);
+		pthread_mutex_lock(&monitor->mutex);
+		callback = monitor->callback;
+		callback_ctx = monitor->callback_ctx;
+		monitor->num_woken = 0;
+		monitor->batch++;
 
 		for (i = 0; i < popped; i++) {
 			msg = &msgs[i];
-			switch (msg->type) {
-			case NDB_INGEST_QUIT:
+			if (msg->type == NDB_MONITOR_QUIT) {
 				done = 1;
-				break;
-
-			case NDB_INGEST_EVENT:
-				out = &outs[to_write];
-				if (ndb_ingester_process_event(ctx, ingester,
-							       &msg->event, out,
-							       read_txn)) {
-					to_write++;
-				}
+				continue;
 			}
+
+			if (monitor->num_subscriptions == 0)
+				continue;
+
+			k.mv_data = &msg->note_key;
+			k.mv_size = sizeof(msg->note_key);
+			if (mdb_get(txn, monitor->lmdb->dbs[NDB_DB_NOTE], &k, &v))
+				continue;
+
+			ndb_monitor_dispatch(monitor, v.mv_data, msg->note_key);
 		}
 
-		if (any_event)
-			mdb_txn_abort(read_txn);
+		pthread_mutex_unlock(&monitor->mutex);
+		mdb_txn_reset(txn);
 
-		if (to_write > 0) {
-			//ndb_debug("pushing %d events to write queue\n", to_write); 
-			if (!ndb_writer_queue_msgs(ingester->writer, outs, to_write)) {
-				ndb_debug("failed pushing %d events to write queue\n", to_write); 
-			}
+		// the queues have already signalled anyone waiting on them.
+		// woken is only touched by this thread so we don't need the lock
+		if (callback) {
+			for (i = 0; i < monitor->num_woken; i++)
+				callback(callback_ctx, monitor->woken[i]);
 		}
 	}
 
-	ndb_debug("quitting ingester thread\n");
-	secp256k1_context_destroy(ctx);
+	if (txn)
+		mdb_txn_abort(txn);
+
+	ndb_debug("quitting monitor thread\n");
 	return NULL;
 }
 
+static int ndb_monitor_init(struct ndb_monitor *monitor, struct ndb_lmdb *lmdb)
+{
+	monitor->lmdb = lmdb;
+	monitor->next_subid = 1;
+	monitor->subscriptions = NULL;
+	monitor->num_subscriptions = 0;
+	monitor->subscriptions_cap = 0;
+	monitor->callback = NULL;
+	monitor->callback_ctx = NULL;
+	monitor->woken = NULL;
+	monitor->num_woken = 0;
+	monitor->woken_cap = 0;
+	monitor->batch = 0;
+	monitor->sub_users = 0;
+	pthread_mutex_init(&monitor->mutex, NULL);
+	pthread_cond_init(&monitor->sub_released, NULL);
+
+	if (!ndb_sub_index_init(&monitor->index)) {
+		fprintf(stderr, "ndb: failed to allocate subscription index");
+		return 0;
+	}
+
+	monitor->queue_buflen = sizeof(struct ndb_monitor_msg) * DEFAULT_QUEUE_SIZE;
+	monitor->queue_buf = malloc(monitor->queue_buflen);
+	if (monitor->queue_buf == NULL) {
+		fprintf(stderr, "ndb: failed to allocate space for monitor queue");
+		return 0;
+	}
+
+	prot_queue_init(&monitor->inbox, monitor->queue_buf,
+			monitor->queue_buflen, sizeof(struct ndb_monitor_msg));
+
+	if (pthread_create(&monitor->thread_id, NULL, ndb_monitor_thread, monitor))
+	{
+		fprintf(stderr, "ndb monitor thread failed to create\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+static void ndb_subscription_destroy(struct ndb_subscription *sub)
+{
+	for (int i = 0; i < sub->num_filters; i++)
+		ndb_filter_destroy(&sub->filters[i]);
+
+	free(sub->filters);
+	prot_queue_destroy(&sub->inbox);
+	free(sub->queue_buf);
+	free(sub);
+}
+
+// Find a subscription and take a reference to it, so it stays around until
+// ndb_subscription_put even if it's unsubscribed in the meantime
+static struct ndb_subscription *
+ndb_subscription_get(struct ndb_monitor *monitor, uint64_t subid)
+{
+	struct ndb_subscription *sub;
+
+	pthread_mutex_lock(&monitor->mutex);
+	if ((sub = ndb_monitor_find_subscription(monitor, subid, NULL))) {
+		sub->refs++;
+		monitor->sub_users++;
+	}
+	pthread_mutex_unlock(&monitor->mutex);
+
+	return sub;
+}
+
+static void ndb_subscription_put(struct ndb_monitor *monitor,
+				 struct ndb_subscription *sub)
+{
+	int refs;
+
+	pthread_mutex_lock(&monitor->mutex);
+	refs = --sub->refs;
+	monitor->sub_users--;
+	pthread_cond_broadcast(&monitor->sub_released);
+	pthread_mutex_unlock(&monitor->mutex);
+
+	// it was unsubscribed while we were using it
+	if (refs == 0)
+		ndb_subscription_destroy(sub);
+}
+
+static int ndb_monitor_destroy(struct ndb_monitor *monitor)
+{
+	struct ndb_monitor_msg msg;
+	int i;
+
+	// the monitor thread is always draining its queue, so this won't
+	// wait for long
+	msg.type = NDB_MONITOR_QUIT;
+	prot_queue_push_wait(&monitor->inbox, &msg);
+	pthread_join(monitor->thread_id, NULL);
+
+	// wake anyone still waiting on a subscription and wait for them to
+	// let go of it
+	pthread_mutex_lock(&monitor->mutex);
+	for (i = 0; i < monitor->num_subscriptions; i++)
+		prot_queue_close(&monitor->subscriptions[i]->inbox);
+	while (monitor->sub_users > 0)
+		pthread_cond_wait(&monitor->sub_released, &monitor->mutex);
+	pthread_mutex_unlock(&monitor->mutex);
+
+	for (i = 0; i < monitor->num_subscriptions; i++)
+		ndb_subscription_destroy(monitor->subscriptions[i]);
+
+	ndb_sub_index_destroy(&monitor->index);
+	free(monitor->subscriptions);
+	free(monitor->woken);
+	monitor->num_subscriptions = 0;
+	pthread_cond_destroy(&monitor->sub_released);
+	pthread_mutex_destroy(&monitor->mutex);
+	prot_queue_destroy(&monitor->inbox);
+	free(monitor->queue_buf);
+
+	return 1;
+}
 
-static int ndb_writer_init(struct ndb_writer *writer, struct ndb_lmdb *lmdb)
+static int ndb_writer_init(struct ndb_writer *writer, struct ndb_lmdb *lmdb,
+			   struct ndb_monitor *monitor)
 {
 	writer->lmdb = lmdb;
+	writer->monitor = monitor;
+
+	if (!ndb_inflight_init(&writer->inflight)) {
+		fprintf(stderr, "ndb: failed to allocate writer inflight set");
+		return 0;
+	}
+
+	if (!ndb_id_filter_init(&writer->ids, lmdb)) {
+		fprintf(stderr, "ndb: failed to build the stored id filter");
+		return 0;
+	}
+
 	writer->queue_buflen = sizeof(struct ndb_writer_msg) * DEFAULT_QUEUE_SIZE;
 	writer->queue_buf = malloc(writer->queue_buflen);
 	if (writer->queue_buf == NULL) {
@@ -881,19 +3493,17 @@ static int ndb_writer_destroy(struct ndb_writer *writer)
 {
 	struct ndb_writer_msg msg;
 
-	// kill thread
+	// kill thread, once it's gotten through what's already queued
 	msg.type = NDB_WRITER_QUIT;
-	if (!prot_queue_push(&writer->inbox, &msg)) {
-		// queue is too full to push quit message. just kill it.
-		pthread_exit(&writer->thread_id);
-	} else {
-		pthread_join(writer->thread_id, NULL);
-	}
+	prot_queue_push_wait(&writer->inbox, &msg);
+	pthread_join(writer->thread_id, NULL);
 
 	// cleanup
 	prot_queue_destroy(&writer->inbox);
 
 	free(writer->queue_buf);
+	ndb_inflight_destroy(&writer->inflight);
+	ndb_id_filter_destroy(&writer->ids);
 
 	return 1;
 }
@@ -905,13 +3515,16 @@ static int ndb_ingester_destroy(struct ndb_ingester *ingester)
 }
 
 static int ndb_ingester_queue_event(struct ndb_ingester *ingester,
-				    char *json, int len)
+				    const char *json, int len,
+				    ndb_release_fn release, void *release_ctx)
 {
 	struct ndb_ingester_msg msg;
 	msg.type = NDB_INGEST_EVENT;
 
 	msg.event.json = json;
 	msg.event.len = len;
+	msg.event.release = release;
+	msg.event.release_ctx = release_ctx;
 
 	return threadpool_dispatch(&ingester->tp, &msg);
 }
@@ -981,6 +3594,34 @@ static int ndb_init_lmdb(const char *filename, struct ndb_lmdb *lmdb, size_t map
 	}
 	mdb_set_compare(txn, lmdb->dbs[NDB_DB_PROFILE_PK], ndb_tsid_compare);
 
+	// pubkey+created_at index. note keys are kept in numeric order so
+	// that notes sharing a timestamp walk in insertion order
+	if ((rc = mdb_dbi_open(txn, "note_pubkey", tsid_flags | MDB_INTEGERDUP, &lmdb->dbs[NDB_DB_NOTE_PUBKEY]))) {
+		fprintf(stderr, "mdb_dbi_open note_pubkey failed, error %d\n", rc);
+		return 0;
+	}
+	mdb_set_compare(txn, lmdb->dbs[NDB_DB_NOTE_PUBKEY], ndb_tsid_compare);
+
+	// kind+created_at index
+	if ((rc = mdb_dbi_open(txn, "note_kind", tsid_flags | MDB_INTEGERDUP, &lmdb->dbs[NDB_DB_NOTE_KIND]))) {
+		fprintf(stderr, "mdb_dbi_open note_kind failed, error %d\n", rc);
+		return 0;
+	}
+	mdb_set_compare(txn, lmdb->dbs[NDB_DB_NOTE_KIND], ndb_u64_tsid_compare);
+
+	// tag+created_at index
+	if ((rc = mdb_dbi_open(txn, "note_tags", tsid_flags | MDB_INTEGERDUP, &lmdb->dbs[NDB_DB_NOTE_TAGS]))) {
+		fprintf(stderr, "mdb_dbi_open note_tags failed, error %d\n", rc);
+		return 0;
+	}
+	mdb_set_compare(txn, lmdb->dbs[NDB_DB_NOTE_TAGS], ndb_tag_key_compare);
+
+	// created_at timeline index
+	if ((rc = mdb_dbi_open(txn, "note_created_at", tsid_flags | MDB_INTEGERKEY | MDB_INTEGERDUP, &lmdb->dbs[NDB_DB_NOTE_CREATED_AT]))) {
+		fprintf(stderr, "mdb_dbi_open note_created_at failed, error %d\n", rc);
+		return 0;
+	}
+
 
 	// Commit the transaction
 	if ((rc = mdb_txn_commit(txn))) {
@@ -1005,7 +3646,15 @@ int ndb_init(struct ndb **pndb, const char *filename, size_t mapsize, int ingest
 	if (!ndb_init_lmdb(filename, &ndb->lmdb, mapsize))
 		return 0;
 
-	if (!ndb_writer_init(&ndb->writer, &ndb->lmdb)) {
+	if (!ndb_read_txns_init(ndb))
+		return 0;
+
+	if (!ndb_monitor_init(&ndb->monitor, &ndb->lmdb)) {
+		fprintf(stderr, "ndb_monitor_init failed");
+		return 0;
+	}
+
+	if (!ndb_writer_init(&ndb->writer, &ndb->lmdb, &ndb->monitor)) {
 		fprintf(stderr, "ndb_writer_init failed");
 		return 0;
 	}
@@ -1016,79 +3665,360 @@ int ndb_init(struct ndb **pndb, const char *filename, size_t mapsize, int ingest
 		return 0;
 	}
 
-	// Initialize LMDB environment and spin up threads
+	// Initialize LMDB environment and spin up threads
+	return 1;
+}
+
+void ndb_destroy(struct ndb *ndb)
+{
+	if (ndb == NULL)
+		return;
+
+	// ingester depends on writer and must be destroyed first
+	ndb_ingester_destroy(&ndb->ingester);
+	ndb_writer_destroy(&ndb->writer);
+	// the monitor gets notified by the writer
+	ndb_monitor_destroy(&ndb->monitor);
+
+	ndb_read_txns_destroy(ndb);
+	mdb_env_close(ndb->lmdb.env);
+
+	free(ndb);
+}
+
+// Process a nostr event, ie: ["EVENT", "subid", {"content":"..."}...]
+// 
+// This function returns as soon as possible, first copying the passed
+// json and then queueing it up for processing. Worker threads then take
+// the json and process it.
+//
+// Processing:
+//
+// 1. The event is parsed into ndb_notes and the signature is validated
+// 2. A quick lookup is made on the database to see if we already have
+//    the note id, if we do we don't need to waste time on json parsing
+//    or note validation.
+// 3. Once validation is done we pass it to the writer queue for writing
+//    to LMDB.
+//
+int ndb_process_event(struct ndb *ndb, const char *json, int json_len)
+{
+	// Since we need to return as soon as possible, and we're not
+	// making any assumptions about the lifetime of the string, we
+	// definitely need to copy the json here. In the future once we
+	// have our thread that manages a websocket connection, we can
+	// avoid the copy and just use the buffer we get from that
+	// thread.
+	char *json_copy = strdupn(json, json_len);
+	if (json_copy == NULL)
+		return 0;
+
+	if (!ndb_ingester_queue_event(&ndb->ingester, json_copy, json_len,
+				      NULL, NULL)) {
+		free(json_copy);
+		return 0;
+	}
+
+	return 1;
+}
+
+// Like ndb_process_event, but without copying the json. The buffer must
+// stay valid until an ingester thread is done with it and calls `release`.
+// If this fails the buffer was never queued and `release` won't be called.
+int ndb_process_event_with_release(struct ndb *ndb, const char *json,
+				   int json_len, ndb_release_fn release,
+				   void *release_ctx)
+{
+	return ndb_ingester_queue_event(&ndb->ingester, json, json_len,
+					release, release_ctx);
+}
+
+int ndb_process_events(struct ndb *ndb, const char *ldjson, size_t json_len)
+{
+	const char *start, *end, *very_end;
+	start = ldjson;
+	end = start + json_len;
+	very_end = ldjson + json_len;
+#if DEBUG
+	int processed = 0;
+#endif
+
+	while ((end = fast_strchr(start, '\n', very_end - start))) {
+		//printf("processing '%.*s'\n", (int)(end-start), start);
+		if (!ndb_process_event(ndb, start, end - start)) {
+			ndb_debug("ndb_process_event failed\n");
+			return 0;
+		}
+		start = end + 1;
+#if DEBUG
+		processed++;
+#endif
+	}
+
+	ndb_debug("ndb_process_events: processed %d events\n", processed);
+
+	return 1;
+}
+
+// a mapped ldjson file, alive until every line has been released
+struct ndb_import {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	size_t pending;
+};
+
+static void ndb_import_release(void *ctx, const char *json, int len)
+{
+	struct ndb_import *import = ctx;
+
+	pthread_mutex_lock(&import->lock);
+	if (--import->pending == 0)
+		pthread_cond_signal(&import->done);
+	pthread_mutex_unlock(&import->lock);
+}
+
+static void ndb_import_dispatch(struct ndb *ndb, struct ndb_import *import,
+				struct ndb_ingester_msg *msgs, int count)
+{
+	pthread_mutex_lock(&import->lock);
+	import->pending += count;
+	pthread_mutex_unlock(&import->lock);
+
+	// when the ingesters are behind, sleep until they make room. a
+	// batch is much smaller than an ingester queue, so it always fits.
+	threadpool_dispatch_all_wait(&ndb->ingester.tp, msgs, count);
+}
+
+// Import a line-delimited json file of events, ie: a relay dump. The file is
+// mapped instead of read, and its lines are handed to the ingesters in large
+// batches without copying. Returns once the ingesters are done with every
+// line. Notes may still be on their way to the writer at that point, use a
+// subscription to find out when they're stored.
+int ndb_import_file(struct ndb *ndb, const char *path)
+{
+	struct ndb_ingester_msg msgs[IMPORT_BATCH], *msg;
+	struct ndb_import import;
+	struct stat st;
+	const char *start, *end, *very_end;
+	void *map;
+	int fd, batched = 0;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		fprintf(stderr, "ndb_import_file: couldn't open %s\n", path);
+		return 0;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return 0;
+	}
+
+	if (st.st_size == 0) {
+		close(fd);
+		return 1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "ndb_import_file: mmap %s failed\n", path);
+		return 0;
+	}
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	pthread_mutex_init(&import.lock, NULL);
+	pthread_cond_init(&import.done, NULL);
+	import.pending = 0;
+
+	start = map;
+	very_end = start + st.st_size;
+
+	for (; start < very_end; start = end + 1) {
+		if (!(end = fast_strchr(start, '\n', very_end - start)))
+			end = very_end;
+
+		if (end == start)
+			continue;
+
+		msg = &msgs[batched++];
+		msg->type = NDB_INGEST_EVENT;
+		msg->event.json = start;
+		msg->event.len = end - start;
+		msg->event.release = ndb_import_release;
+		msg->event.release_ctx = &import;
+
+		if (batched == IMPORT_BATCH) {
+			ndb_import_dispatch(ndb, &import, msgs, batched);
+			batched = 0;
+		}
+	}
+
+	if (batched > 0)
+		ndb_import_dispatch(ndb, &import, msgs, batched);
+
+	// the ingesters are still reading from the mapping
+	pthread_mutex_lock(&import.lock);
+	while (import.pending > 0)
+		pthread_cond_wait(&import.done, &import.lock);
+	pthread_mutex_unlock(&import.lock);
+
+	pthread_cond_destroy(&import.done);
+	pthread_mutex_destroy(&import.lock);
+	munmap(map, st.st_size);
+
+	return 1;
+}
+
+static struct ndb_subscription *ndb_subscription_new(struct ndb_filter *filters,
+						    int num_filters)
+{
+	struct ndb_subscription *sub;
+	int buflen = sizeof(uint64_t) * SUBSCRIPTION_QUEUE_SIZE;
+
+	if (!(sub = calloc(1, sizeof(*sub))))
+		return NULL;
+
+	if (!(sub->queue_buf = malloc(buflen)))
+		goto fail;
+
+	if (!(sub->filters = malloc(sizeof(*filters) * num_filters)))
+		goto fail;
+
+	memcpy(sub->filters, filters, sizeof(*filters) * num_filters);
+	sub->num_filters = num_filters;
+	sub->refs = 1;
+	prot_queue_init(&sub->inbox, sub->queue_buf, buflen, sizeof(uint64_t));
+
+	return sub;
+
+fail:
+	free(sub->queue_buf);
+	free(sub);
+	return NULL;
+}
+
+// Subscribe to notes matching any of the filters as they are written. The
+// subscription takes ownership of the filters and destroys them when
+// unsubscribed. Returns the subscription id, or 0 on failure.
+uint64_t ndb_subscribe(struct ndb *ndb, struct ndb_filter *filters, int num_filters)
+{
+	struct ndb_monitor *monitor = &ndb->monitor;
+	struct ndb_subscription *sub, **subs;
+	int i, cap;
+
+	if (!(sub = ndb_subscription_new(filters, num_filters)))
+		return 0;
+
+	pthread_mutex_lock(&monitor->mutex);
+
+	if (monitor->num_subscriptions == monitor->subscriptions_cap) {
+		cap = monitor->subscriptions_cap ? monitor->subscriptions_cap * 2 : 32;
+		subs = realloc(monitor->subscriptions, sizeof(*subs) * cap);
+		if (subs == NULL)
+			goto fail;
+		monitor->subscriptions = subs;
+		monitor->subscriptions_cap = cap;
+	}
+
+	for (i = 0; i < num_filters; i++) {
+		if (!ndb_sub_index_filter(&monitor->index, sub, &sub->filters[i])) {
+			ndb_sub_index_remove(&monitor->index, sub);
+			goto fail;
+		}
+	}
+
+	sub->subid = monitor->next_subid++;
+	monitor->subscriptions[monitor->num_subscriptions++] = sub;
+
+	pthread_mutex_unlock(&monitor->mutex);
+	return sub->subid;
+
+fail:
+	pthread_mutex_unlock(&monitor->mutex);
+	// the caller still owns the filters
+	sub->num_filters = 0;
+	ndb_subscription_destroy(sub);
+	return 0;
+}
+
+// Remove a subscription. Anyone waiting on it is woken up, and it's freed
+// once they're done with it.
+int ndb_unsubscribe(struct ndb *ndb, uint64_t subid)
+{
+	struct ndb_monitor *monitor = &ndb->monitor;
+	struct ndb_subscription *sub;
+	int i, refs;
+
+	pthread_mutex_lock(&monitor->mutex);
+
+	if (!(sub = ndb_monitor_find_subscription(monitor, subid, &i))) {
+		pthread_mutex_unlock(&monitor->mutex);
+		return 0;
+	}
+
+	ndb_sub_index_remove(&monitor->index, sub);
+
+	// keep the subscriptions packed
+	monitor->subscriptions[i] =
+		monitor->subscriptions[--monitor->num_subscriptions];
+
+	refs = --sub->refs;
+	pthread_mutex_unlock(&monitor->mutex);
+
+	prot_queue_close(&sub->inbox);
+	if (refs == 0)
+		ndb_subscription_destroy(sub);
 	return 1;
 }
 
-void ndb_destroy(struct ndb *ndb)
+// Called from the monitor thread with the subid of each subscription that got
+// new notes. Poll for the notes from here or wake something up that will.
+void ndb_set_subscription_callback(struct ndb *ndb, ndb_sub_fn fn, void *ctx)
 {
-	if (ndb == NULL)
-		return;
-
-	// ingester depends on writer and must be destroyed first
-	ndb_ingester_destroy(&ndb->ingester);
-	ndb_writer_destroy(&ndb->writer);
-
-	mdb_env_close(ndb->lmdb.env);
-
-	free(ndb);
+	pthread_mutex_lock(&ndb->monitor.mutex);
+	ndb->monitor.callback = fn;
+	ndb->monitor.callback_ctx = ctx;
+	pthread_mutex_unlock(&ndb->monitor.mutex);
 }
 
-// Process a nostr event, ie: ["EVENT", "subid", {"content":"..."}...]
-// 
-// This function returns as soon as possible, first copying the passed
-// json and then queueing it up for processing. Worker threads then take
-// the json and process it.
-//
-// Processing:
-//
-// 1. The event is parsed into ndb_notes and the signature is validated
-// 2. A quick lookup is made on the database to see if we already have
-//    the note id, if we do we don't need to waste time on json parsing
-//    or note validation.
-// 3. Once validation is done we pass it to the writer queue for writing
-//    to LMDB.
-//
-int ndb_process_event(struct ndb *ndb, const char *json, int json_len)
+// Take the keys of any new notes for a subscription without blocking
+int ndb_poll_for_notes(struct ndb *ndb, uint64_t subid, uint64_t *note_keys,
+		       int note_key_capacity)
 {
-	// Since we need to return as soon as possible, and we're not
-	// making any assumptions about the lifetime of the string, we
-	// definitely need to copy the json here. In the future once we
-	// have our thread that manages a websocket connection, we can
-	// avoid the copy and just use the buffer we get from that
-	// thread.
-	char *json_copy = strdupn(json, json_len);
-	if (json_copy == NULL)
+	struct ndb_subscription *sub;
+	int count = 0;
+
+	if (!(sub = ndb_subscription_get(&ndb->monitor, subid)))
 		return 0;
 
-	return ndb_ingester_queue_event(&ndb->ingester, json_copy, json_len);
+	while (count < note_key_capacity &&
+	       prot_queue_try_pop(&sub->inbox, &note_keys[count]))
+		count++;
+
+	ndb_subscription_put(&ndb->monitor, sub);
+	return count;
 }
 
-int ndb_process_events(struct ndb *ndb, const char *ldjson, size_t json_len)
+// Block until a subscription has new notes, then take their keys. Returns 0
+// if the subscription is removed while we wait.
+int ndb_wait_for_notes(struct ndb *ndb, uint64_t subid, uint64_t *note_keys,
+		       int note_key_capacity)
 {
-	const char *start, *end, *very_end;
-	start = ldjson;
-	end = start + json_len;
-	very_end = ldjson + json_len;
-#if DEBUG
-	int processed = 0;
-#endif
+	struct ndb_subscription *sub;
+	int count;
 
-	while ((end = fast_strchr(start, '\n', very_end - start))) {
-		//printf("processing '%.*s'\n", (int)(end-start), start);
-		if (!ndb_process_event(ndb, start, end - start)) {
-			ndb_debug("ndb_process_event failed\n");
-			return 0;
-		}
-		start = end + 1;
-#if DEBUG
-		processed++;
-#endif
-	}
+	if (note_key_capacity <= 0)
+		return 0;
 
-	ndb_debug("ndb_process_events: processed %d events\n", processed);
+	if (!(sub = ndb_subscription_get(&ndb->monitor, subid)))
+		return 0;
 
-	return 1;
+	count = prot_queue_pop_all(&sub->inbox, note_keys, note_key_capacity);
+
+	ndb_subscription_put(&ndb->monitor, sub);
+	return count;
 }
 
 static inline int cursor_push_tag(struct cursor *cur, struct ndb_tag *tag)
@@ -1096,11 +4026,21 @@ static inline int cursor_push_tag(struct cursor *cur, struct ndb_tag *tag)
 	return cursor_push_u16(cur, tag->count);
 }
 
+// Deduped strings are found through an open addressing table in
+// str_indices. Slots hold a string's offset + 1, so zero is empty.
+#define NDB_STR_SLOTS_MAX (1 << 14)
+
+static inline uint32_t *ndb_builder_str_table(struct ndb_builder *builder)
+{
+	return (uint32_t *)(((uintptr_t)builder->str_indices.start + 3) & ~3);
+}
+
 int ndb_builder_init(struct ndb_builder *builder, unsigned char *buf,
 		     int bufsize)
 {
 	struct ndb_note *note;
 	int half, size, str_indices_size;
+	uint32_t slots;
 
 	// come on bruh
 	if (bufsize < sizeof(struct ndb_note) * 2)
@@ -1124,6 +4064,16 @@ int ndb_builder_init(struct ndb_builder *builder, unsigned char *buf,
 		return 0;
 	}
 
+	// the string dedupe table gets the biggest power of two that fits
+	// after aligning it
+	slots = 1;
+	while (slots < NDB_STR_SLOTS_MAX &&
+	       (int)(slots * 2 * sizeof(uint32_t)) <= str_indices_size - 3)
+		slots *= 2;
+	builder->str_slots = slots;
+	builder->num_strs = 0;
+	memset(ndb_builder_str_table(builder), 0, slots * sizeof(uint32_t));
+
 	memset(note, 0, sizeof(*note));
 	builder->note_cur.p += sizeof(*note);
 
@@ -1171,8 +4121,21 @@ static inline int ndb_json_parser_parse(struct ndb_json_parser *p,
 {
 	jsmntok_t *tok;
 	int cap = ((unsigned char *)p->toks_end - (unsigned char*)p->toks)/sizeof(*p->toks);
-	int res =
-		jsmn_parse(&p->json_parser, p->json, p->json_len, p->toks, cap, cb != NULL);
+	int res;
+
+	// jsmn is only needed when we have to stop at the id. the indexer
+	// gives up on anything unusual, jsmn gets the final say on those
+	if (cb == NULL) {
+		res = json_index_parse(p->json, p->json_len, p->toks, cap);
+		if (res > 0) {
+			p->num_tokens = res;
+			p->i = 0;
+			return 1;
+		}
+	}
+
+	res = jsmn_parse(&p->json_parser, p->json, p->json_len, p->toks, cap,
+			 cb != NULL);
 
 	// got an ID!
 	if (res == -42) {
@@ -1215,162 +4178,14 @@ static int cursor_push_unescaped_char(struct cursor *cur, char c1, char c2)
 	}
 }
 
-static int cursor_push_escaped_char(struct cursor *cur, char c)
-{
-        switch (c) {
-        case '"':  return cursor_push_str(cur, "\\\"");
-        case '\\': return cursor_push_str(cur, "\\\\");
-        case '\b': return cursor_push_str(cur, "\\b");
-        case '\f': return cursor_push_str(cur, "\\f");
-        case '\n': return cursor_push_str(cur, "\\n");
-        case '\r': return cursor_push_str(cur, "\\r");
-        case '\t': return cursor_push_str(cur, "\\t");
-        // TODO: \u hex hex hex hex
-        }
-        return cursor_push_byte(cur, c);
-}
-
-static int cursor_push_hex_str(struct cursor *cur, unsigned char *buf, int len)
-{
-	int i;
-
-	if (len % 2 != 0)
-		return 0;
-
-        if (!cursor_push_byte(cur, '"'))
-                return 0;
-
-	for (i = 0; i < len; i++) {
-		unsigned int c = ((const unsigned char *)buf)[i];
-		if (!cursor_push_byte(cur, hexchar(c >> 4)))
-			return 0;
-		if (!cursor_push_byte(cur, hexchar(c & 0xF)))
-			return 0;
-	}
-
-        if (!cursor_push_byte(cur, '"'))
-                return 0;
-
-	return 1;
-}
-
-static int cursor_push_jsonstr(struct cursor *cur, const char *str)
-{
-	int i;
-        int len;
-
-	len = strlen(str);
-
-        if (!cursor_push_byte(cur, '"'))
-                return 0;
-
-        for (i = 0; i < len; i++) {
-                if (!cursor_push_escaped_char(cur, str[i]))
-                        return 0;
-        }
-
-        if (!cursor_push_byte(cur, '"'))
-                return 0;
-
-        return 1;
-}
-
-
-static inline int cursor_push_json_tag_str(struct cursor *cur, struct ndb_str str)
-{
-	if (str.flag == NDB_PACKED_ID)
-		return cursor_push_hex_str(cur, str.id, 32);
-
-	return cursor_push_jsonstr(cur, str.str);
-}
-
-static int cursor_push_json_tag(struct cursor *cur, struct ndb_note *note,
-				struct ndb_tag *tag)
-{
-        int i;
-
-        if (!cursor_push_byte(cur, '['))
-                return 0;
-
-        for (i = 0; i < tag->count; i++) {
-                if (!cursor_push_json_tag_str(cur, ndb_note_str(note, &tag->strs[i])))
-                        return 0;
-                if (i != tag->count-1 && !cursor_push_byte(cur, ','))
-			return 0;
-        }
-
-        return cursor_push_byte(cur, ']');
-}
-
-static int cursor_push_json_tags(struct cursor *cur, struct ndb_note *note)
-{
-	int i;
-	struct ndb_iterator iter, *it = &iter;
-	ndb_tags_iterate_start(note, it);
-
-        if (!cursor_push_byte(cur, '['))
-                return 0;
-
-	i = 0;
-	while (ndb_tags_iterate_next(it)) {
-		if (!cursor_push_json_tag(cur, note, it->tag))
-			return 0;
-                if (i != note->tags.count-1 && !cursor_push_str(cur, ","))
-			return 0;
-		i++;
-	}
-
-        if (!cursor_push_byte(cur, ']'))
-                return 0;
-
-	return 1;
-}
-
-static int ndb_event_commitment(struct ndb_note *ev, unsigned char *buf, int buflen)
+// buf and buflen are unused since the commitment is hashed as it is
+// generated. They're kept so existing callers don't break.
+int ndb_calculate_id(struct ndb_note *note, unsigned char *buf, int buflen)
 {
-	char timebuf[16] = {0};
-	char kindbuf[16] = {0};
-	char pubkey[65];
-	struct cursor cur;
-	int ok;
-
-	if (!hex_encode(ev->pubkey, sizeof(ev->pubkey), pubkey, sizeof(pubkey)))
-		return 0;
-
-	make_cursor(buf, buf + buflen, &cur);
-
-	// TODO: update in 2106 ...
-	snprintf(timebuf, sizeof(timebuf), "%d", (uint32_t)ev->created_at);
-	snprintf(kindbuf, sizeof(kindbuf), "%d", ev->kind);
-
-	ok =
-		cursor_push_str(&cur, "[0,\"") &&
-		cursor_push_str(&cur, pubkey) &&
-		cursor_push_str(&cur, "\",") &&
-		cursor_push_str(&cur, timebuf) &&
-		cursor_push_str(&cur, ",") &&
-		cursor_push_str(&cur, kindbuf) &&
-		cursor_push_str(&cur, ",") &&
-		cursor_push_json_tags(&cur, ev) &&
-		cursor_push_str(&cur, ",") &&
-		cursor_push_jsonstr(&cur, ndb_note_str(ev, &ev->content).str) &&
-		cursor_push_str(&cur, "]");
-
-	if (!ok)
-		return 0;
+	struct sha256 id;
 
-	return cur.p - cur.start;
-}
-
-int ndb_calculate_id(struct ndb_note *note, unsigned char *buf, int buflen) {
-	int len;
-
-	if (!(len = ndb_event_commitment(note, buf, buflen)))
-		return 0;
-
-	//fprintf(stderr, "%.*s\n", len, buf);
-
-	sha256((struct sha256*)note->id, buf, len);
+	ndb_event_commitment_hash(note, &id);
+	memcpy(note->id, id.u.u8, 32);
 
 	return 1;
 }
@@ -1380,6 +4195,7 @@ int ndb_sign_id(struct ndb_keypair *keypair, unsigned char id[32],
 {
 	unsigned char aux[32];
 	secp256k1_keypair *pair = (secp256k1_keypair*) keypair->pair;
+	int ok;
 
 	if (!fill_random(aux, sizeof(aux)))
 		return 0;
@@ -1387,27 +4203,31 @@ int ndb_sign_id(struct ndb_keypair *keypair, unsigned char id[32],
 	secp256k1_context *ctx =
 		secp256k1_context_create(SECP256K1_CONTEXT_NONE);
 
-	return secp256k1_schnorrsig_sign32(ctx, sig, id, pair, aux);
+	ok = secp256k1_schnorrsig_sign32(ctx, sig, id, pair, aux);
+	secp256k1_context_destroy(ctx);
+
+	return ok;
 }
 
 int ndb_create_keypair(struct ndb_keypair *kp)
 {
 	secp256k1_keypair *keypair = (secp256k1_keypair*)kp->pair;
 	secp256k1_xonly_pubkey pubkey;
+	int ok;
 
 	secp256k1_context *ctx =
-		secp256k1_context_create(SECP256K1_CONTEXT_NONE);;
+		secp256k1_context_create(SECP256K1_CONTEXT_NONE);
 
 	/* Try to create a keypair with a valid context, it should only
 	 * fail if the secret key is zero or out of range. */
-	if (!secp256k1_keypair_create(ctx, keypair, kp->secret))
-		return 0;
-
-	if (!secp256k1_keypair_xonly_pub(ctx, &pubkey, NULL, keypair))
-		return 0;
+	ok = secp256k1_keypair_create(ctx, keypair, kp->secret) &&
+	     secp256k1_keypair_xonly_pub(ctx, &pubkey, NULL, keypair) &&
+	     /* Serialize the public key. Should always return 1 for a
+	      * valid public key. */
+	     secp256k1_xonly_pubkey_serialize(ctx, kp->pubkey, &pubkey);
 
-	/* Serialize the public key. Should always return 1 for a valid public key. */
-	return secp256k1_xonly_pubkey_serialize(ctx, kp->pubkey, &pubkey);
+	secp256k1_context_destroy(ctx);
+	return ok;
 }
 
 int ndb_decode_key(const char *secstr, struct ndb_keypair *keypair)
@@ -1440,13 +4260,9 @@ int ndb_builder_finalize(struct ndb_builder *builder, struct ndb_note **note,
 
 	// generate id and sign if we're building this manually
 	if (keypair) {
-		// use the remaining memory for building our id buffer
-		unsigned char *end   = builder->mem.end;
-		unsigned char *start = (unsigned char*)(*note) + total_size;
-
 		ndb_builder_set_pubkey(builder, keypair->pubkey);
 
-		if (!ndb_calculate_id(builder->note, start, end - start))
+		if (!ndb_calculate_id(builder->note, NULL, 0))
 			return 0;
 
 		if (!ndb_sign_id(keypair, (*note)->id, (*note)->sig))
@@ -1464,21 +4280,46 @@ struct ndb_note * ndb_builder_note(struct ndb_builder *builder)
 	return builder->note;
 }
 
-/// find an existing string via str_indices. these indices only exist in the
-/// builder phase just for this purpose.
+static inline uint32_t ndb_str_hash(const unsigned char *str, int len)
+{
+	uint64_t h = 0x9E3779B97F4A7C15ULL * (len + 1), w;
+
+	for (; len >= 8; len -= 8, str += 8) {
+		memcpy(&w, str, 8);
+		h = (h ^ w) * 0xbf58476d1ce4e5b9ULL;
+		h ^= h >> 31;
+	}
+
+	if (len > 0) {
+		w = 0;
+		memcpy(&w, str, len);
+		h = (h ^ w) * 0xbf58476d1ce4e5b9ULL;
+		h ^= h >> 31;
+	}
+
+	return h ^ (h >> 32);
+}
+
+/// find an existing string via the str_indices table. It only exists in
+/// the builder phase just for this purpose.
 static inline int ndb_builder_find_str(struct ndb_builder *builder,
-				       const char *str, int len,
+				       const char *str, int len, uint32_t hash,
 				       union ndb_packed_str *pstr)
 {
-	// find existing matching string to avoid duplicate strings
-	int indices = cursor_count(&builder->str_indices, sizeof(uint32_t));
-	for (int i = 0; i < indices; i++) {
-		uint32_t index = ((uint32_t*)builder->str_indices.start)[i];
-		const char *some_str = (const char*)builder->strings.start + index;
-
-		if (!memcmp(some_str, str, len)) {
-			// found an existing matching str, use that index
-			*pstr = ndb_offset_str(index);
+	uint32_t *table = ndb_builder_str_table(builder);
+	uint32_t mask = builder->str_slots - 1, i, loc;
+	unsigned char *strings = builder->strings.start;
+	size_t used = builder->strings.p - strings;
+
+	// the table is never full, so we always hit an empty slot
+	for (i = hash & mask; table[i]; i = (i + 1) & mask) {
+		loc = table[i] - 1;
+
+		// also matches ids with the same bytes, which are stored
+		// nul terminated like any other string
+		if (loc + len < used && strings[loc + len] == '\0' &&
+		    !memcmp(strings + loc, str, len)) {
+			*pstr = ndb_offset_str(loc);
 			return 1;
 		}
 	}
@@ -1486,8 +4327,26 @@ static inline int ndb_builder_find_str(struct ndb_builder *builder,
 	return 0;
 }
 
+static inline void ndb_builder_add_str(struct ndb_builder *builder,
+				       uint32_t loc, uint32_t hash)
+{
+	uint32_t *table = ndb_builder_str_table(builder);
+	uint32_t mask = builder->str_slots - 1, i;
+
+	// past this load, just stop deduping
+	if (builder->num_strs + 1 > builder->str_slots / 4 * 3)
+		return;
+
+	for (i = hash & mask; table[i]; i = (i + 1) & mask)
+		;
+
+	table[i] = loc + 1;
+	builder->num_strs++;
+}
+
 static int ndb_builder_push_str(struct ndb_builder *builder, const char *str,
-				int len, union ndb_packed_str *pstr)
+				int len, uint32_t hash,
+				union ndb_packed_str *pstr)
 {
 	uint32_t loc;
 
@@ -1500,9 +4359,8 @@ static int ndb_builder_push_str(struct ndb_builder *builder, const char *str,
 
 	*pstr = ndb_offset_str(loc);
 
-	// record in builder indices. ignore return value, if we can't cache it
-	// then whatever
-	cursor_push_u32(&builder->str_indices, loc);
+	// record in builder indices so we can find it again
+	ndb_builder_add_str(builder, loc, hash);
 
 	return 1;
 }
@@ -1511,15 +4369,10 @@ static int ndb_builder_push_packed_id(struct ndb_builder *builder,
 				      unsigned char *id,
 				      union ndb_packed_str *pstr)
 {
-	// Don't both find id duplicates. very rarely are they duplicated
-	// and it slows things down quite a bit. If we really care about this
-	// We can switch to a hash table.
-	//if (ndb_builder_find_str(builder, (const char*)id, 32, pstr)) {
-	//	pstr->packed.flag = NDB_PACKED_ID;
-	//	return 1;
-	//}
+	uint32_t hash = ndb_str_hash(id, 32);
 
-	if (ndb_builder_push_str(builder, (const char*)id, 32, pstr)) {
+	if (ndb_builder_find_str(builder, (const char*)id, 32, hash, pstr) ||
+	    ndb_builder_push_str(builder, (const char*)id, 32, hash, pstr)) {
 		pstr->packed.flag = NDB_PACKED_ID;
 		return 1;
 	}
@@ -1534,7 +4387,7 @@ static inline int ndb_builder_try_compact_str(struct ndb_builder *builder,
 					      union ndb_packed_str *pstr,
 					      int pack_ids)
 {
-	unsigned char id_buf[32];
+	unsigned char id_buf[32], ok;
 
 	if (len == 0) {
 		*pstr = ndb_char_to_packed_str(0);
@@ -1545,7 +4398,8 @@ static inline int ndb_builder_try_compact_str(struct ndb_builder *builder,
 	} else if (len == 2) {
 		*pstr = ndb_chars_to_packed_str(str[0], str[1]);
 		return 1;
-	} else if (pack_ids && len == 64 && hex_decode(str, 64, id_buf, 32)) {
+	} else if (pack_ids && len == 64 &&
+		   hex_decode_ids(&str, 1, &id_buf, &ok)) {
 		return ndb_builder_push_packed_id(builder, id_buf, pstr);
 	}
 
@@ -1557,10 +4411,12 @@ static int ndb_builder_push_unpacked_str(struct ndb_builder *builder,
 					 const char *str, int len,
 					 union ndb_packed_str *pstr)
 {
-	if (ndb_builder_find_str(builder, str, len, pstr))
+	uint32_t hash = ndb_str_hash((const unsigned char *)str, len);
+
+	if (ndb_builder_find_str(builder, str, len, hash, pstr))
 		return 1;
 
-	return ndb_builder_push_str(builder, str, len, pstr);
+	return ndb_builder_push_str(builder, str, len, hash, pstr);
 }
 
 int ndb_builder_make_str(struct ndb_builder *builder, const char *str, int len,
@@ -1612,16 +4468,19 @@ static int ndb_builder_make_json_str(struct ndb_builder *builder,
 				     union ndb_packed_str *pstr,
 				     int *written, int pack_ids)
 {
-	// let's not care about de-duping these. we should just unescape
-	// in-place directly into the strings table. 
+	// unescape in-place directly into the strings table, then dedupe
+	// what we wrote
 	if (written)
 		*written = len;
 
 	const char *p, *end, *start;
 	unsigned char *builder_start;
+	uint32_t hash;
 
-	// always try compact strings first
-	if (ndb_builder_try_compact_str(builder, str, len, pstr, pack_ids))
+	// always try compact strings first, unless it's an escaped
+	// character that we need to unescape below
+	if (!(len == 2 && str[0] == '\\') &&
+	    ndb_builder_try_compact_str(builder, str, len, pstr, pack_ids))
 		return 1;
 
 	end = str + len;
@@ -1630,33 +4489,42 @@ static int ndb_builder_make_json_str(struct ndb_builder *builder,
 	*pstr = ndb_offset_str(builder->strings.p - builder->strings.start);
 	builder_start = builder->strings.p;
 
-	for (p = str; p < end; p++) {
-		if (*p == '\\' && p+1 < end) {
-			// Push the chunk of unescaped characters before this escape sequence
-			if (start < p && !cursor_push(&builder->strings,
-						(unsigned char *)start,
-						p - start)) {
-				return 0;
-			}
+	// skip to each escape with a vectorized search and copy the runs
+	// between them in one go
+	while ((p = fast_strchr(start, '\\', end - start)) && p+1 < end) {
+		// Push the chunk of unescaped characters before this escape sequence
+		if (start < p && !cursor_push(&builder->strings,
+					      (unsigned char *)start,
+					      p - start)) {
+			return 0;
+		}
 
-			if (!cursor_push_unescaped_char(&builder->strings, *p, *(p+1)))
-				return 0;
+		if (!cursor_push_unescaped_char(&builder->strings, *p, *(p+1)))
+			return 0;
 
-			p++; // Skip the character following the backslash
-			start = p + 1; // Update the start pointer to the next character
-		}
+		// Skip the character following the backslash
+		start = p + 2;
 	}
 
 	// Handle the last chunk after the last escape sequence (or if there are no escape sequences at all)
-	if (start < p && !cursor_push(&builder->strings, (unsigned char *)start,
-				      p - start)) {
+	if (start < end && !cursor_push(&builder->strings, (unsigned char *)start,
+					end - start)) {
 		return 0;
 	}
 
+	len = builder->strings.p - builder_start;
 	if (written)
-		*written = builder->strings.p - builder_start;
+		*written = len;
+
+	hash = ndb_str_hash(builder_start, len);
+	if (ndb_builder_find_str(builder, (const char *)builder_start, len,
+				 hash, pstr)) {
+		builder->strings.p = builder_start;
+		return 1;
+	}
 
-	// TODO: dedupe these!?
+	ndb_builder_add_str(builder, builder_start - builder->strings.start,
+			    hash);
 	return cursor_push_byte(&builder->strings, '\0');
 }
 
@@ -1670,12 +4538,26 @@ static int ndb_builder_push_json_tag(struct ndb_builder *builder,
 	return ndb_builder_finalize_tag(builder, pstr);
 }
 
+// Tags are pushed in batches, so the 64-char strings in them can be decoded
+// as ids in one pass
+#define NDB_TAG_ID_BATCH 64
+
+struct ndb_tag_ids {
+	const char *strs[NDB_TAG_ID_BATCH];
+	unsigned char ids[NDB_TAG_ID_BATCH][32];
+	unsigned char ok[NDB_TAG_ID_BATCH];
+	int count, next;
+};
+
 // Push a json array into an ndb tag ["p", "abcd..."] -> struct ndb_tag
 static int ndb_builder_tag_from_json_array(struct ndb_json_parser *p,
-					   jsmntok_t *array)
+					   jsmntok_t *array,
+					   struct ndb_tag_ids *ids)
 {
 	jsmntok_t *str_tok;
 	const char *str;
+	union ndb_packed_str pstr;
+	int k;
 
 	if (array->size == 0)
 		return 0;
@@ -1687,6 +4569,17 @@ static int ndb_builder_tag_from_json_array(struct ndb_json_parser *p,
 		str_tok = &array[i+1];
 		str = p->json + str_tok->start;
 
+		// already decoded with the rest of the batch
+		if (ids->next < ids->count && ids->strs[ids->next] == str &&
+		    ids->ok[k = ids->next++]) {
+			if (!ndb_builder_push_packed_id(&p->builder,
+							ids->ids[k], &pstr) ||
+			    !ndb_builder_finalize_tag(&p->builder, pstr)) {
+				return 0;
+			}
+			continue;
+		}
+
 		if (!ndb_builder_push_json_tag(&p->builder, str,
 					       toksize(str_tok))) {
 			return 0;
@@ -1701,15 +4594,29 @@ static int ndb_builder_tag_from_json_array(struct ndb_json_parser *p,
 static inline int ndb_builder_process_json_tags(struct ndb_json_parser *p,
 						jsmntok_t *array)
 {
-	jsmntok_t *tag = array;
+	struct ndb_tag_ids ids;
+	jsmntok_t *tag = array + 1, *batch;
+	int i = 0, j, k;
+
+	while (i < array->size) {
+		// find the id sized strings in the next batch of tags
+		ids.count = ids.next = 0;
+		batch = tag;
+		for (j = i; j < array->size && ids.count < NDB_TAG_ID_BATCH; j++) {
+			for (k = 1; k <= tag->size && ids.count < NDB_TAG_ID_BATCH; k++) {
+				if (toksize(&tag[k]) == 64)
+					ids.strs[ids.count++] = p->json + tag[k].start;
+			}
+			tag += tag->size + 1;
+		}
 
-	if (array->size == 0)
-		return 1;
+		hex_decode_ids(ids.strs, ids.count, ids.ids, ids.ok);
 
-	for (int i = 0; i < array->size; i++) {
-		if (!ndb_builder_tag_from_json_array(p, &tag[i+1]))
-			return 0;
-		tag += tag[i+1].size;
+		for (; i < j; i++) {
+			if (!ndb_builder_tag_from_json_array(p, batch, &ids))
+				return 0;
+			batch += batch->size + 1;
+		}
 	}
 
 	return 1;
@@ -1745,6 +4652,133 @@ static int parse_unsigned_int(const char *start, int len, unsigned int *num)
 	return 1;
 }
 
+static inline const char *ndb_sniff_ws(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+		p++;
+	return p;
+}
+
+// skip past the end of the string we're in. p is just past the opening quote
+static const char *ndb_sniff_string(const char *p, const char *end)
+{
+	while ((p = fast_strchr_any(p, "\"\\", 2, end - p))) {
+		if (*p == '"')
+			return p + 1;
+		// skip the escaped character
+		p += 2;
+		if (p >= end)
+			break;
+	}
+
+	return NULL;
+}
+
+// skip over an object member's value
+static const char *ndb_sniff_value(const char *p, const char *end)
+{
+	int depth = 0;
+
+	for (; p < end; p++) {
+		switch (*p) {
+		case '"':
+			if (!(p = ndb_sniff_string(p + 1, end)))
+				return NULL;
+			if (depth == 0)
+				return p;
+			p--;
+			break;
+		case '[':
+		case '{':
+			depth++;
+			break;
+		case ']':
+		case '}':
+			if (depth == 0)
+				return p;
+			if (--depth == 0)
+				return p + 1;
+			break;
+		case ',':
+			if (depth == 0)
+				return p;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static inline int ndb_sniff_char(const char **p, const char *end, char c)
+{
+	*p = ndb_sniff_ws(*p, end);
+	if (*p >= end || **p != c)
+		return 0;
+	(*p)++;
+	return 1;
+}
+
+// Find the id in an ["EVENT","subid",{...}] message without tokenizing it,
+// so duplicates can be dropped before jsmn sees them. This only looks at
+// the event's own members. Returns 0 when the message is laid out in some
+// way we don't expect, or has more than one id, the parser will deal with
+// it itself.
+static int ndb_sniff_event_id(const char *json, int len, const char **hexid)
+{
+	const char *p = json, *end = json + len, *key;
+	unsigned char v;
+	int i, is_id;
+
+	*hexid = NULL;
+
+	if (!ndb_sniff_char(&p, end, '[') || !ndb_sniff_char(&p, end, '"') ||
+	    end - p < 6 || memcmp(p, "EVENT\"", 6))
+		return 0;
+	p += 6;
+
+	if (!ndb_sniff_char(&p, end, ',') || !ndb_sniff_char(&p, end, '"') ||
+	    !(p = ndb_sniff_string(p, end)) ||
+	    !ndb_sniff_char(&p, end, ',') || !ndb_sniff_char(&p, end, '{'))
+		return 0;
+
+	for (;;) {
+		if (!ndb_sniff_char(&p, end, '"'))
+			return 0;
+
+		key = p;
+		if (!(p = ndb_sniff_string(p, end)))
+			return 0;
+		is_id = p - key == 3 && key[0] == 'i' && key[1] == 'd';
+
+		if (!ndb_sniff_char(&p, end, ':'))
+			return 0;
+
+		if (is_id) {
+			// we keep going to the end of the event to make
+			// sure there isn't another one
+			if (*hexid || !ndb_sniff_char(&p, end, '"') ||
+			    end - p < 65 || p[64] != '"')
+				return 0;
+
+			for (i = 0; i < 64; i++) {
+				if (!char_to_hex(&v, p[i]))
+					return 0;
+			}
+
+			*hexid = p;
+			p += 65;
+		} else if (!(p = ndb_sniff_value(ndb_sniff_ws(p, end), end))) {
+			return 0;
+		}
+
+		if (ndb_sniff_char(&p, end, '}'))
+			return *hexid != NULL;
+
+		if (!ndb_sniff_char(&p, end, ','))
+			return 0;
+	}
+}
+
 int ndb_ws_event_from_json(const char *json, int len, struct ndb_tce *tce,
 			   unsigned char *buf, int bufsize,
 			   struct ndb_id_cb *cb)
@@ -1752,10 +4786,20 @@ int ndb_ws_event_from_json(const char *json, int len, struct ndb_tce *tce,
 	jsmntok_t *tok = NULL;
 	int tok_len, res;
 	struct ndb_json_parser parser;
+	const char *hexid;
 
 	tce->subid_len = 0;
 	tce->subid = "";
 
+	// relays send us lots of events we already have. look for the id
+	// up front so we don't tokenize all of those just to find it
+	if (cb && ndb_sniff_event_id(json, len, &hexid)) {
+		if (cb->fn(cb->data, hexid) == NDB_IDRES_STOP)
+			return -42;
+		// we've already checked it
+		cb = NULL;
+	}
+
 	ndb_json_parser_init(&parser, json, len, buf, bufsize);
 	if ((res = ndb_json_parser_parse(&parser, cb)) < 0)
 		return res;
@@ -1866,8 +4910,12 @@ int ndb_parse_json_note(struct ndb_json_parser *parser, struct ndb_note **note)
 			hex_decode(json + tok->start, toksize(tok), hexbuf, sizeof(hexbuf));
 			parsed |= NDB_PARSED_PUBKEY;
 			ndb_builder_set_pubkey(&parser->builder, hexbuf);
-		} else if (tok_len == 2 && start[0] == 'i' && start[1] == 'd') {
-			// id
+		} else if (tok_len == 2 && start[0] == 'i' && start[1] == 'd' &&
+			   tok->parent == parser->i) {
+			// id. only the event's own, and only one of them, so
+			// the id we store is the one ndb_sniff_event_id saw
+			if (parsed & NDB_PARSED_ID)
+				return 0;
 			tok = &parser->toks[i+1];
 			hex_decode(json + tok->start, toksize(tok), hexbuf, sizeof(hexbuf));
 			parsed |= NDB_PARSED_ID;
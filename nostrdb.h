@@ -30,6 +30,19 @@ enum tce_type {
 	NDB_TCE_EOSE   = 0x4,
 };
 
+// called when a subscription has new notes
+typedef void (*ndb_sub_fn)(void *ctx, uint64_t subid);
+
+// called by an ingester thread when it's done with a json buffer passed to
+// ndb_process_event_with_release
+typedef void (*ndb_release_fn)(void *ctx, const char *json, int len);
+
+// controls whether to continue or stop the json parser
+enum ndb_idres {
+	NDB_IDRES_CONT,
+	NDB_IDRES_STOP,
+};
+
 // function pointer for controlling what to do after we parse an id
 typedef enum ndb_idres (*ndb_id_fn)(void *, const char *);
 
@@ -133,6 +146,8 @@ struct ndb_builder {
 	struct cursor str_indices;
 	struct ndb_note *note;
 	struct ndb_tag *current_tag;
+	uint32_t str_slots;
+	uint32_t num_strs;
 };
 
 struct ndb_iterator {
@@ -143,6 +158,115 @@ struct ndb_iterator {
 	int index;
 };
 
+enum ndb_filter_fieldtype {
+	NDB_FILTER_IDS     = 1,
+	NDB_FILTER_AUTHORS = 2,
+	NDB_FILTER_KINDS   = 3,
+	NDB_FILTER_TAGS    = 4,
+	NDB_FILTER_SINCE   = 5,
+	NDB_FILTER_UNTIL   = 6,
+	NDB_FILTER_LIMIT   = 7,
+};
+
+// the maximum number of fields in a filter. tag fields (#e, #p, ...) each
+// take up their own field
+#define NDB_MAX_FILTER_FIELDS 16
+
+// when matching generic tags, we need to know if we're dealing with
+// a pointer to a 32-byte ID or a null terminated string
+enum ndb_generic_element_type {
+	NDB_ELEMENT_UNKNOWN = 0,
+	NDB_ELEMENT_STRING  = 1,
+	NDB_ELEMENT_ID      = 2,
+};
+
+union ndb_filter_element {
+	const char *string;
+	const unsigned char *id;
+	uint64_t integer;
+};
+
+struct ndb_filter_field {
+	enum ndb_filter_fieldtype type;
+	enum ndb_generic_element_type elem_type;
+	char generic; // for tag queries like #t
+};
+
+struct ndb_filter_elements {
+	struct ndb_filter_field field;
+	int count;
+	union ndb_filter_element elements[0];
+};
+
+struct ndb_filter {
+	struct cursor elem_buf;
+	struct cursor data_buf;
+	int num_elements;
+	struct ndb_filter_elements *current;
+	struct ndb_filter_elements *elements[NDB_MAX_FILTER_FIELDS];
+};
+
+enum ndb_iter_index {
+	NDB_ITER_AUTHOR     = 1, // a pubkey's notes
+	NDB_ITER_KIND       = 2, // notes of a kind
+	NDB_ITER_CREATED_AT = 3, // all notes
+	NDB_ITER_TAG        = 4, // notes with a tag value
+	NDB_ITER_NOTE_KEY   = 5, // the note store in key order
+};
+
+// iterator flags, see ndb_note_iter_set_flags
+#define NDB_ITER_ASCENDING (1 << 0) // oldest (or lowest key) first
+#define NDB_ITER_PREFETCH  (1 << 1) // prefetch the next note while on this one
+
+// A read transaction. Lookups made with it see a single snapshot of the
+// database and their results stay valid until ndb_end_query. A thread can
+// only have one open at a time.
+struct ndb_txn {
+	struct ndb *ndb;
+	void *mdb_txn;
+};
+
+// Walks notes over the note store or one of the created_at-clustered
+// indexes. Notes point directly into the database and are valid until the
+// txn ends.
+struct ndb_note_iter {
+	struct ndb_txn *txn;
+	void *cursor;
+	enum ndb_iter_index index;
+	int flags;
+	int started;
+
+	// index prefix we're walking followed by the start timestamp, or
+	// the start note key for the note store. The index comparators
+	// read the u64 parts in place, so it has to be 8-byte aligned.
+	unsigned char key[144] __attribute__((aligned(8)));
+	int keylen;
+
+	// a tag value too long for the index key, notes are checked against
+	// the whole thing
+	const char *value;
+
+	// the current note
+	struct ndb_note *note;
+	size_t note_len;
+	uint64_t note_key;
+
+	// the note after it, when prefetching
+	struct ndb_note *next_note;
+	size_t next_len;
+	uint64_t next_key;
+	int has_next;
+};
+
+// return 0 to stop iterating
+typedef int (*ndb_note_iter_fn)(void *ctx, struct ndb_note *note, size_t note_len, uint64_t note_key);
+
+struct ndb_query_result {
+	struct ndb_note *note;
+	uint64_t note_size;
+	uint64_t note_key;
+};
+
 // HELPERS
 int ndb_calculate_id(struct ndb_note *note, unsigned char *buf, int buflen);
 int ndb_sign_id(struct ndb_keypair *keypair, unsigned char id[32], unsigned char sig[64]);
@@ -153,12 +277,50 @@ int ndb_note_verify(void *secp_ctx, unsigned char pubkey[32], unsigned char id[3
 // NDB
 int ndb_init(struct ndb **ndb, const char *dbdir, size_t mapsize, int ingester_threads);
 int ndb_process_event(struct ndb *, const char *json, int len);
+int ndb_process_event_with_release(struct ndb *, const char *json, int len, ndb_release_fn release, void *release_ctx);
 int ndb_process_events(struct ndb *, const char *ldjson, size_t len);
-void *ndb_get_profile_by_pubkey(struct ndb *, const unsigned char *pubkey, size_t *len);
-struct ndb_note *ndb_get_note_by_id(struct ndb *, const unsigned char *id, size_t *len);
-struct ndb_note *ndb_get_note_by_key(struct ndb *, uint64_t key, size_t *len);
+int ndb_import_file(struct ndb *, const char *path);
+int ndb_begin_query(struct ndb *, struct ndb_txn *);
+void ndb_end_query(struct ndb_txn *);
+void *ndb_get_profile_by_pubkey(struct ndb_txn *txn, const unsigned char *pubkey, size_t *len);
+struct ndb_note *ndb_get_note_by_id(struct ndb_txn *txn, const unsigned char *id, size_t *len);
+struct ndb_note *ndb_get_note_by_key(struct ndb_txn *txn, uint64_t key, size_t *len);
+int ndb_get_notes_by_ids(struct ndb_txn *txn, const unsigned char *ids, int n, struct ndb_note **notes, size_t *lens);
+int ndb_get_profiles_by_pubkeys(struct ndb_txn *txn, const unsigned char *pubkeys, int n, void **profiles, size_t *lens);
+int ndb_query(struct ndb_txn *txn, struct ndb_filter *filters, int num_filters, struct ndb_query_result *results, int result_capacity, int *count);
 void ndb_destroy(struct ndb *);
 
+// ITERATORS
+int ndb_note_iter_start_author(struct ndb_txn *, struct ndb_note_iter *, const unsigned char *pubkey, uint64_t start);
+int ndb_note_iter_start_kind(struct ndb_txn *, struct ndb_note_iter *, uint32_t kind, uint64_t start);
+int ndb_note_iter_start_created_at(struct ndb_txn *, struct ndb_note_iter *, uint64_t start);
+int ndb_note_iter_start_tag_str(struct ndb_txn *, struct ndb_note_iter *, char tag, const char *value, uint64_t start);
+int ndb_note_iter_start_tag_id(struct ndb_txn *, struct ndb_note_iter *, char tag, const unsigned char *id, uint64_t start);
+int ndb_note_iter_start_note_key(struct ndb_txn *, struct ndb_note_iter *, uint64_t start);
+void ndb_note_iter_set_flags(struct ndb_note_iter *, int flags);
+int ndb_note_iter_next(struct ndb_note_iter *);
+int ndb_note_iter_foreach(struct ndb_note_iter *, ndb_note_iter_fn fn, void *ctx);
+void ndb_note_iter_end(struct ndb_note_iter *);
+
+// SUBSCRIPTIONS
+uint64_t ndb_subscribe(struct ndb *, struct ndb_filter *filters, int num_filters);
+int ndb_unsubscribe(struct ndb *, uint64_t subid);
+void ndb_set_subscription_callback(struct ndb *, ndb_sub_fn fn, void *ctx);
+int ndb_poll_for_notes(struct ndb *, uint64_t subid, uint64_t *note_keys, int note_key_capacity);
+int ndb_wait_for_notes(struct ndb *, uint64_t subid, uint64_t *note_keys, int note_key_capacity);
+
+// FILTERS
+int ndb_filter_init(struct ndb_filter *);
+int ndb_filter_start_field(struct ndb_filter *, enum ndb_filter_fieldtype);
+int ndb_filter_start_tag_field(struct ndb_filter *, char tag);
+int ndb_filter_add_id_element(struct ndb_filter *, const unsigned char *id);
+int ndb_filter_add_int_element(struct ndb_filter *, uint64_t integer);
+// 64 char lowercase hex strings are added as ids, like notes store them
+int ndb_filter_add_str_element(struct ndb_filter *, const char *str);
+void ndb_filter_end_field(struct ndb_filter *);
+int ndb_filter_matches(struct ndb_filter *, struct ndb_note *);
+void ndb_filter_destroy(struct ndb_filter *);
+
 // BUILDER
 int ndb_parse_json_note(struct ndb_json_parser *, struct ndb_note **);
 int ndb_ws_event_from_json(const char *json, int len, struct ndb_tce *tce, unsigned char *buf, int bufsize, struct ndb_id_cb *);
@@ -33,9 +33,11 @@ struct prot_queue {
 	int tail;
 	int count;
 	int elem_size;
+	int closed;
 
 	pthread_mutex_t mutex;
-	pthread_cond_t cond;
+	pthread_cond_t cond;  // signaled when elements are pushed
+	pthread_cond_t space; // signaled when elements are popped
 };
 
 
@@ -61,9 +63,11 @@ static inline int prot_queue_init(struct prot_queue* q, void* buf,
 	q->buf = buf;
 	q->buflen = buflen;
 	q->elem_size = elem_size;
+	q->closed = 0;
 
 	pthread_mutex_init(&q->mutex, NULL);
 	pthread_cond_init(&q->cond, NULL);
+	pthread_cond_init(&q->space, NULL);
 
 	return 1;
 }
@@ -108,15 +112,31 @@ static int prot_queue_push(struct prot_queue* q, void *data)
 }
 
 /*
- * Push multiple elements onto the queue.
+ * Push an element onto the queue, waiting for space if it's full.
  * Params:
- * q      - Pointer to the queue.
- * data   - Pointer to the data elements to be pushed.
- * count  - Number of elements to push.
- *
- * Returns the number of elements successfully pushed, 0 if the queue is full or if there is not enough contiguous space.
+ * q    - Pointer to the queue.
+ * data - Pointer to the data element to be pushed.
  */
-static int prot_queue_push_all(struct prot_queue* q, void *data, int count)
+static void prot_queue_push_wait(struct prot_queue* q, void *data)
+{
+	int cap;
+
+	pthread_mutex_lock(&q->mutex);
+
+	cap = prot_queue_capacity(q);
+	while (q->count == cap)
+		pthread_cond_wait(&q->space, &q->mutex);
+
+	memcpy(&q->buf[q->tail * q->elem_size], data, q->elem_size);
+	q->tail = (q->tail + 1) % cap;
+	q->count++;
+
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+static int prot_queue_push_all_internal(struct prot_queue* q, void *data,
+					int count, int wait)
 {
 	int cap;
 	int first_copy_count, second_copy_count;
@@ -124,9 +144,13 @@ static int prot_queue_push_all(struct prot_queue* q, void *data, int count)
 	pthread_mutex_lock(&q->mutex);
 
 	cap = prot_queue_capacity(q);
-	if (q->count + count > cap) {
-		pthread_mutex_unlock(&q->mutex);
-		return 0; // Return failure if the queue is full
+	while (q->count + count > cap) {
+		// Return failure if the queue is full, or could never fit them
+		if (!wait || count > cap) {
+			pthread_mutex_unlock(&q->mutex);
+			return 0;
+		}
+		pthread_cond_wait(&q->space, &q->mutex);
 	}
 
 	first_copy_count = min(count, cap - q->tail); // Elements until the end of the buffer
@@ -149,6 +173,32 @@ static int prot_queue_push_all(struct prot_queue* q, void *data, int count)
 	return count;
 }
 
+/*
+ * Push multiple elements onto the queue.
+ * Params:
+ * q      - Pointer to the queue.
+ * data   - Pointer to the data elements to be pushed.
+ * count  - Number of elements to push.
+ *
+ * Returns the number of elements successfully pushed, 0 if the queue is full or if there is not enough contiguous space.
+ */
+static int prot_queue_push_all(struct prot_queue* q, void *data, int count)
+{
+	return prot_queue_push_all_internal(q, data, count, 0);
+}
+
+/*
+ * Push multiple elements onto the queue, waiting until there's space for
+ * all of them.
+ *
+ * Returns the number of elements pushed, 0 if they can't fit in the queue
+ * even when it's empty.
+ */
+static int prot_queue_push_all_wait(struct prot_queue* q, void *data, int count)
+{
+	return prot_queue_push_all_internal(q, data, count, 1);
+}
+
 /* 
  * Try to pop an element from the queue without blocking.
  * Params:
@@ -168,6 +218,7 @@ static inline int prot_queue_try_pop(struct prot_queue *q, void *data) {
 	q->head = (q->head + 1) % prot_queue_capacity(q);
 	q->count--;
 
+	pthread_cond_signal(&q->space);
 	pthread_mutex_unlock(&q->mutex);
 	return 1;
 }
@@ -180,16 +231,22 @@ static inline int prot_queue_try_pop(struct prot_queue *q, void *data) {
  * q		 - Pointer to the queue.
  * buffer	 - Pointer to the buffer where popped data will be stored.
  * max_items - Maximum number of items to pop from the queue.
- * Returns the actual number of items popped.
+ * Returns the actual number of items popped, 0 once the queue is closed and
+ * empty.
  */
 static int prot_queue_pop_all(struct prot_queue *q, void *dest, int max_items) {
 	pthread_mutex_lock(&q->mutex);
 
 	// Wait until there's at least one item to pop
-	while (q->count == 0) {
+	while (q->count == 0 && !q->closed) {
 		pthread_cond_wait(&q->cond, &q->mutex);
 	}
 
+	if (q->count == 0) {
+		pthread_mutex_unlock(&q->mutex);
+		return 0;
+	}
+
 	int items_until_end = (q->buflen - q->head * q->elem_size) / q->elem_size;
 	int items_to_pop = min(q->count, max_items);
 	items_to_pop = min(items_to_pop, items_until_end);
@@ -198,6 +255,7 @@ static int prot_queue_pop_all(struct prot_queue *q, void *dest, int max_items) {
 	q->head = (q->head + items_to_pop) % prot_queue_capacity(q);
 	q->count -= items_to_pop;
 
+	pthread_cond_broadcast(&q->space);
 	pthread_mutex_unlock(&q->mutex);
 
 	return items_to_pop;
@@ -219,6 +277,20 @@ static inline void prot_queue_pop(struct prot_queue *q, void *data) {
 	q->head = (q->head + 1) % prot_queue_capacity(q);
 	q->count--;
 
+	pthread_cond_signal(&q->space);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+/*
+ * Close the queue, waking anything blocked in prot_queue_pop_all. Elements
+ * that are still queued can be popped, after that pops return 0.
+ * Params:
+ * q - Pointer to the queue.
+ */
+static inline void prot_queue_close(struct prot_queue *q) {
+	pthread_mutex_lock(&q->mutex);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->cond);
 	pthread_mutex_unlock(&q->mutex);
 }
 
@@ -230,6 +302,7 @@ static inline void prot_queue_pop(struct prot_queue *q, void *data) {
 static inline void prot_queue_destroy(struct prot_queue* q) {
 	pthread_mutex_destroy(&q->mutex);
 	pthread_cond_destroy(&q->cond);
+	pthread_cond_destroy(&q->space);
 }
 
 #endif // PROT_QUEUE_H
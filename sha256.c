@@ -13,6 +13,13 @@
 #include <assert.h>
 #include <string.h>
 
+#if !defined(CCAN_CRYPTO_SHA256_USE_OPENSSL) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SHA256_X86 1
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
 static void invalidate_sha256(struct sha256_ctx *ctx)
 {
 #ifdef CCAN_CRYPTO_SHA256_USE_OPENSSL
@@ -167,6 +174,127 @@ static void Transform(uint32_t *s, const uint32_t *chunk)
 	s[7] += h;
 }
 
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/** Process nblocks 64-byte chunks with the portable Transform. */
+static void sha256_blocks_generic(uint32_t *s, const unsigned char *data,
+				  size_t nblocks)
+{
+	uint32_t chunk[16];
+
+	for (; nblocks; nblocks--, data += 64) {
+		if (alignment_ok(data, sizeof(uint32_t)))
+			Transform(s, (const uint32_t *)data);
+		else {
+			memcpy(chunk, data, sizeof(chunk));
+			Transform(s, chunk);
+		}
+	}
+}
+
+#if SHA256_X86
+/* Runtime CPU detection, so a default build still uses the SHA
+ * extensions on machines that have them. */
+static bool sha256_has_shani(void)
+{
+	static int has_shani = -1;
+	unsigned int eax, ebx, ecx, edx, sha = 0;
+
+	if (has_shani == -1) {
+		if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+			sha = ebx & bit_SHA;
+		has_shani = sha &&
+			__get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+			(ecx & bit_SSSE3) && (ecx & bit_SSE4_1);
+	}
+
+	return has_shani;
+}
+
+/** Four rounds with the SHA-NI instructions. */
+#define SHANI_ROUNDS(state0, state1, msg, i) do {			\
+	__m128i wk = _mm_add_epi32(msg,					\
+		_mm_loadu_si128((const __m128i *)&sha256_k[4*(i)]));	\
+	state1 = _mm_sha256rnds2_epu32(state1, state0, wk);		\
+	wk = _mm_shuffle_epi32(wk, 0x0E);				\
+	state0 = _mm_sha256rnds2_epu32(state0, state1, wk);		\
+} while (0)
+
+/** The next four message words from the previous sixteen. */
+#define SHANI_SCHEDULE(m0, m1, m2, m3)					\
+	(m0 = _mm_sha256msg2_epu32(_mm_add_epi32(			\
+		_mm_sha256msg1_epu32(m0, m1),				\
+		_mm_alignr_epi8(m3, m2, 4)), m3))
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_shani(uint32_t *s, const unsigned char *data,
+				size_t nblocks)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+					     0x0405060700010203ULL);
+	__m128i state0, state1, tmp, abef, cdgh, m0, m1, m2, m3;
+	int i;
+
+	/* The instructions want the state as ABEF and CDGH */
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&s[0]), 0xB1);
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&s[4]), 0x1B);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	for (; nblocks; nblocks--, data += 64) {
+		abef = state0;
+		cdgh = state1;
+
+		m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data +  0)), bswap);
+		m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), bswap);
+		m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), bswap);
+		m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), bswap);
+
+		SHANI_ROUNDS(state0, state1, m0, 0);
+		SHANI_ROUNDS(state0, state1, m1, 1);
+		SHANI_ROUNDS(state0, state1, m2, 2);
+		SHANI_ROUNDS(state0, state1, m3, 3);
+
+		for (i = 4; i < 16; i += 4) {
+			SHANI_ROUNDS(state0, state1, SHANI_SCHEDULE(m0, m1, m2, m3), i);
+			SHANI_ROUNDS(state0, state1, SHANI_SCHEDULE(m1, m2, m3, m0), i+1);
+			SHANI_ROUNDS(state0, state1, SHANI_SCHEDULE(m2, m3, m0, m1), i+2);
+			SHANI_ROUNDS(state0, state1, SHANI_SCHEDULE(m3, m0, m1, m2), i+3);
+		}
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	/* Back to ABCD and EFGH */
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	_mm_storeu_si128((__m128i *)&s[0], _mm_blend_epi16(tmp, state1, 0xF0));
+	_mm_storeu_si128((__m128i *)&s[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif /* SHA256_X86 */
+
+/** Process nblocks 64-byte chunks with the fastest code this CPU has. */
+static void sha256_blocks(uint32_t *s, const unsigned char *data, size_t nblocks)
+{
+#if SHA256_X86
+	if (sha256_has_shani()) {
+		sha256_blocks_shani(s, data, nblocks);
+		return;
+	}
+#endif
+	sha256_blocks_generic(s, data, nblocks);
+}
+
 
 static void add(struct sha256_ctx *ctx, const void *p, size_t len)
 {
@@ -179,21 +307,18 @@ static void add(struct sha256_ctx *ctx, const void *p, size_t len)
 		ctx->bytes += 64 - bufsize;
 		data += 64 - bufsize;
 		len -= 64 - bufsize;
-		Transform(ctx->s, ctx->buf.u32);
+		sha256_blocks(ctx->s, ctx->buf.u8, 1);
 		bufsize = 0;
 	}
 
-	while (len >= 64) {
+	if (len >= 64) {
 		/* Process full chunks directly from the source. */
-		if (alignment_ok(data, sizeof(uint32_t)))
-			Transform(ctx->s, (const uint32_t *)data);
-		else {
-			memcpy(ctx->buf.u8, data, sizeof(ctx->buf));
-			Transform(ctx->s, ctx->buf.u32);
-		}
-		ctx->bytes += 64;
-		data += 64;
-		len -= 64;
+		size_t nblocks = len / 64;
+
+		sha256_blocks(ctx->s, data, nblocks);
+		ctx->bytes += nblocks * 64;
+		data += nblocks * 64;
+		len -= nblocks * 64;
 	}
 
 	if (len) {
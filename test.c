@@ -4,6 +4,10 @@
 #include "io.h"
 #include "protected_queue.h"
 #include "memchr.h"
+#include "inflight.h"
+#include "sha256.h"
+#define JSMN_STATIC
+#include "json_index.h"
 #include "bindings/c/profile_reader.h"
 #include "bindings/c/profile_verifier.h"
 
@@ -17,6 +21,7 @@ static const char *test_dir = "./testdata/db";
 
 static void test_load_profiles()
 {
+	struct ndb_txn txn;
 	static const int alloc_size = 1024 * 1024;
 	char *json = malloc(alloc_size);
 	unsigned char *buf = malloc(alloc_size);
@@ -35,16 +40,18 @@ static void test_load_profiles()
 	ndb_destroy(ndb);
 
 	assert(ndb_init(&ndb, test_dir, mapsize, ingester_threads));
+	assert(ndb_begin_query(ndb, &txn));
 	unsigned char id[32] = {
 	  0x22, 0x05, 0x0b, 0x6d, 0x97, 0xbb, 0x9d, 0xa0, 0x9e, 0x90, 0xed, 0x0c,
 	  0x6d, 0xd9, 0x5e, 0xed, 0x1d, 0x42, 0x3e, 0x27, 0xd5, 0xcb, 0xa5, 0x94,
 	  0xd2, 0xb4, 0xd1, 0x3a, 0x55, 0x43, 0x09, 0x07 };
 	const char *expected_content = "{\"website\":\"selenejin.com\",\"lud06\":\"\",\"nip05\":\"selenejin@BitcoinNostr.com\",\"picture\":\"https://nostr.build/i/3549697beda0fe1f4ae621f359c639373d92b7c8d5c62582b656c5843138c9ed.jpg\",\"display_name\":\"Selene Jin\",\"about\":\"INTJ | Founding Designer @Blockstream\",\"name\":\"SeleneJin\"}";
 
-	struct ndb_note *note = ndb_get_note_by_id(ndb, id, NULL);
+	struct ndb_note *note = ndb_get_note_by_id(&txn, id, NULL);
 	assert(note != NULL);
 	assert(!strcmp(ndb_note_content(note), expected_content));
 
+	ndb_end_query(&txn);
 	ndb_destroy(ndb);
 
 	free(json);
@@ -179,7 +186,7 @@ static void test_parse_contact_list()
 	size = ndb_note_from_json((const char*)json, written, &note, buf, alloc_size);
 	printf("ndb_note_from_json size %d\n", size);
 	assert(size > 0);
-	assert(size == 34328);
+	assert(size == 34208);
 
 	memcpy(id, note->id, 32);
 	memset(note->id, 0, 32);
@@ -248,6 +255,7 @@ static void test_parse_contact_list()
 
 static void test_fetch_last_noteid()
 {
+	struct ndb_txn txn;
 	static const int alloc_size = 1024 * 1024;
 	char *json = malloc(alloc_size);
 	unsigned char *buf = malloc(alloc_size);
@@ -265,10 +273,11 @@ static void test_fetch_last_noteid()
 	ndb_destroy(ndb);
 
 	assert(ndb_init(&ndb, test_dir, mapsize, ingester_threads));
+	assert(ndb_begin_query(ndb, &txn));
 
 	unsigned char id[32] = { 0xdc, 0x96, 0x4f, 0x4c, 0x89, 0x83, 0x64, 0x13, 0x8e, 0x81, 0x96, 0xf0, 0xc7, 0x33, 0x38, 0xc8, 0xcc, 0x3e, 0xbf, 0xa3, 0xaf, 0xdd, 0xbc, 0x7d, 0xd1, 0x58, 0xb4, 0x84, 0x7c, 0x1e, 0xbf, 0xa0 };
 
-	struct ndb_note *note = ndb_get_note_by_id(ndb, id, &len);
+	struct ndb_note *note = ndb_get_note_by_id(&txn, id, &len);
 	assert(note != NULL);
 	assert(note->created_at == 1650054135);
 	
@@ -278,7 +287,7 @@ static void test_fetch_last_noteid()
 		0xd1, 0x2c, 0x17, 0xbd, 0xe3, 0x09, 0x4a, 0xd3, 0x2f, 0x4a, 0xb8, 0x62, 0xa6, 0xcc, 0x6f, 0x5c, 0x28, 0x9c, 0xfe, 0x7d, 0x58, 0x02, 0x27, 0x0b, 0xdf, 0x34, 0x90, 0x4d, 0xf5, 0x85, 0xf3, 0x49
 	};
 
-	void *root = ndb_get_profile_by_pubkey(ndb, pk, &len);
+	void *root = ndb_get_profile_by_pubkey(&txn, pk, &len);
 
 	assert(root);
 	int res = NdbProfileRecord_verify_as_root(root, len);
@@ -297,17 +306,996 @@ static void test_fetch_last_noteid()
 
 	printf("note_key %" PRIu64 "\n", key);
 
-	struct ndb_note *n = ndb_get_note_by_key(ndb, key, NULL);
+	struct ndb_note *n = ndb_get_note_by_key(&txn, key, NULL);
 	assert(memcmp(profile_note_id, n->id, 32) == 0);
 
 	//fwrite(profile, len, 1, stdout);
 
+	ndb_end_query(&txn);
 	ndb_destroy(ndb);
 
 	free(json);
 	free(buf);
 }
 
+static void test_multi_get()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_note *notes[4];
+	void *profiles[2];
+	size_t lens[4], mapsize;
+	unsigned char ids[4*32], pks[2*32];
+
+	mapsize = 1024 * 1024 * 100;
+	assert(ndb_init(&ndb, test_dir, mapsize, 1));
+	assert(ndb_begin_query(ndb, &txn));
+
+	hex_decode("dc964f4c898364138e8196f0c73338c8cc3ebfa3afddbc7dd158b4847c1ebfa0", 64, ids, 32);
+	memset(ids + 32, 0, 32);
+	hex_decode("b2e03951843b191b5d9d1969f48db0156b83cc7dbd841f543f109362e24c4a9c", 64, ids + 64, 32);
+	memcpy(ids + 96, ids, 32);
+
+	assert(ndb_get_notes_by_ids(&txn, ids, 4, notes, lens) == 3);
+	assert(notes[0] && notes[0]->created_at == 1650054135);
+	assert(notes[1] == NULL && lens[1] == 0);
+	assert(notes[2] && notes[2]->created_at == 1650050002);
+	assert(notes[3] == notes[0] && lens[3] == lens[0]);
+
+	hex_decode("32e1827635450ebb3c5a7d12c1f8e7b2b514439ac10a67eef3d9fd9c5c68e245", 64, pks, 32);
+	memset(pks + 32, 0xff, 32);
+
+	assert(ndb_get_profiles_by_pubkeys(&txn, pks, 2, profiles, NULL) == 1);
+	assert(profiles[0] != NULL);
+	assert(profiles[1] == NULL);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+}
+
+static void test_filters()
+{
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_note *note;
+	unsigned char buffer[4096];
+	unsigned char id[32], pk[32];
+
+	const char *json = "{\"id\":\"dc964f4c898364138e8196f0c73338c8cc3ebfa3afddbc7dd158b4847c1ebfa0\",\"pubkey\":\"32e1827635450ebb3c5a7d12c1f8e7b2b514439ac10a67eef3d9fd9c5c68e245\",\"created_at\":1650054135,\"kind\":1,\"tags\":[[\"p\",\"fd3fdb0d0d8d6f9a7667b53211de8ae3c5246b79bdaf64ebac849d5148b5615f\"],[\"t\",\"nostr\"]],\"content\":\"I'm at this account now\",\"sig\":\"f9cda8d9b1b2c3a0afb1a1d6d6f3ba3f5d0f5c46ad4dd6cf7e0a3c6ed1b4bfb0e1dcfa6d6ba7f3f3e8c9bd1ea5a7d6b2d6e0b5b8aef9d6fbd6b0e7d3a0c7e3b3f2\"}";
+
+	assert(ndb_note_from_json(json, strlen(json), &note, buffer, sizeof(buffer)));
+
+	hex_decode("fd3fdb0d0d8d6f9a7667b53211de8ae3c5246b79bdaf64ebac849d5148b5615f", 64, id, 32);
+	hex_decode("32e1827635450ebb3c5a7d12c1f8e7b2b514439ac10a67eef3d9fd9c5c68e245", 64, pk, 32);
+
+	// kinds + authors
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 0));
+	assert(ndb_filter_add_int_element(f, 1));
+	assert(!ndb_filter_add_id_element(f, pk));
+	ndb_filter_end_field(f);
+	assert(!ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_start_field(f, NDB_FILTER_AUTHORS));
+	assert(ndb_filter_add_id_element(f, pk));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_matches(f, note));
+	ndb_filter_destroy(f);
+
+	// #p and #t tags
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_tag_field(f, 'p'));
+	assert(ndb_filter_add_id_element(f, id));
+	assert(!ndb_filter_add_str_element(f, "nostr"));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_tag_field(f, 't'));
+	assert(ndb_filter_add_str_element(f, "bitcoin"));
+	ndb_filter_end_field(f);
+	assert(!ndb_filter_matches(f, note));
+	ndb_filter_destroy(f);
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_tag_field(f, 't'));
+	assert(ndb_filter_add_str_element(f, "bitcoin"));
+	assert(ndb_filter_add_str_element(f, "nostr"));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_matches(f, note));
+	ndb_filter_destroy(f);
+
+	// ids given as hex strings match the packed ids in the note
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_tag_field(f, 'p'));
+	assert(ndb_filter_add_str_element(f, "fd3fdb0d0d8d6f9a7667b53211de8ae3c5246b79bdaf64ebac849d5148b5615f"));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_matches(f, note));
+	ndb_filter_destroy(f);
+
+	// since/until
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_SINCE));
+	assert(ndb_filter_add_int_element(f, 1650054135));
+	assert(!ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_matches(f, note));
+	assert(ndb_filter_start_field(f, NDB_FILTER_UNTIL));
+	assert(ndb_filter_add_int_element(f, 1650054134));
+	ndb_filter_end_field(f);
+	assert(!ndb_filter_matches(f, note));
+	ndb_filter_destroy(f);
+}
+
+static void test_query()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_filter filters[2], *f = &filters[0];
+	struct ndb_query_result results[8];
+	size_t mapsize;
+	int count;
+
+	unsigned char pk[32] = { 0x32, 0xe1, 0x82, 0x76, 0x35, 0x45, 0x0e, 0xbb, 0x3c, 0x5a, 0x7d, 0x12, 0xc1, 0xf8, 0xe7, 0xb2, 0xb5, 0x14, 0x43, 0x9a, 0xc1, 0x0a, 0x67, 0xee, 0xf3, 0xd9, 0xfd, 0x9c, 0x5c, 0x68, 0xe2, 0x45 };
+	unsigned char e_id[32];
+	hex_decode("8bc0f167205a099454f6638043c3747b474b16bca77966a0f0c09dfaec0768bf", 64, e_id, 32);
+
+	// uses the notes written by test_fetch_last_noteid
+	mapsize = 1024 * 1024 * 100;
+	assert(ndb_init(&ndb, test_dir, mapsize, 1));
+	assert(ndb_begin_query(ndb, &txn));
+
+	// latest two kind 1 notes by jb55
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_AUTHORS));
+	assert(ndb_filter_add_id_element(f, pk));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_field(f, NDB_FILTER_LIMIT));
+	assert(ndb_filter_add_int_element(f, 2));
+	ndb_filter_end_field(f);
+
+	assert(ndb_query(&txn, f, 1, results, ARRAY_SIZE(results), &count));
+	assert(count == 2);
+	assert(results[0].note->created_at == 1650054135);
+	assert(results[1].note->created_at == 1650053582);
+	ndb_filter_destroy(f);
+
+	// everything in a time window, plus a tag query. results are
+	// merged newest first
+	assert(ndb_filter_init(&filters[0]));
+	assert(ndb_filter_start_field(&filters[0], NDB_FILTER_SINCE));
+	assert(ndb_filter_add_int_element(&filters[0], 1650000000));
+	ndb_filter_end_field(&filters[0]);
+	assert(ndb_filter_start_field(&filters[0], NDB_FILTER_UNTIL));
+	assert(ndb_filter_add_int_element(&filters[0], 1650050002));
+	ndb_filter_end_field(&filters[0]);
+
+	assert(ndb_filter_init(&filters[1]));
+	assert(ndb_filter_start_tag_field(&filters[1], 'e'));
+	assert(ndb_filter_add_id_element(&filters[1], e_id));
+	ndb_filter_end_field(&filters[1]);
+
+	assert(ndb_query(&txn, filters, 2, results, ARRAY_SIZE(results), &count));
+	assert(count == 3);
+	assert(results[0].note->created_at == 1650054135);
+	assert(results[1].note->created_at == 1650050002);
+	assert(results[2].note->created_at == 1650049978);
+	assert(results[2].note->kind == 0);
+
+	// result capacity caps the total
+	assert(ndb_query(&txn, filters, 2, results, 1, &count));
+	assert(count == 1);
+	assert(results[0].note->created_at == 1650054135);
+
+	ndb_filter_destroy(&filters[0]);
+	ndb_filter_destroy(&filters[1]);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+}
+
+static void test_author_iter()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_note_iter iter, *it = &iter;
+	size_t mapsize;
+	int count;
+
+	unsigned char pk[32] = { 0x32, 0xe1, 0x82, 0x76, 0x35, 0x45, 0x0e, 0xbb, 0x3c, 0x5a, 0x7d, 0x12, 0xc1, 0xf8, 0xe7, 0xb2, 0xb5, 0x14, 0x43, 0x9a, 0xc1, 0x0a, 0x67, 0xee, 0xf3, 0xd9, 0xfd, 0x9c, 0x5c, 0x68, 0xe2, 0x45 };
+	uint64_t expected[] = { 1650054135, 1650053582, 1650051200, 1650050002, 1650049978 };
+
+	mapsize = 1024 * 1024 * 100;
+	assert(ndb_init(&ndb, test_dir, mapsize, 1));
+	assert(ndb_begin_query(ndb, &txn));
+
+	// everything, newest first
+	count = 0;
+	assert(ndb_note_iter_start_author(&txn, it, pk, UINT64_MAX));
+	while (ndb_note_iter_next(it)) {
+		assert(!memcmp(it->note->pubkey, pk, 32));
+		assert(it->note->created_at == expected[count]);
+		count++;
+	}
+	ndb_note_iter_end(it);
+	assert(count == ARRAY_SIZE(expected));
+
+	// until is inclusive
+	assert(ndb_note_iter_start_author(&txn, it, pk, 1650053582));
+	assert(ndb_note_iter_next(it));
+	assert(it->note->created_at == 1650053582);
+	assert(ndb_note_iter_next(it));
+	assert(it->note->created_at == 1650051200);
+	ndb_note_iter_end(it);
+
+	// nothing before the first note
+	assert(ndb_note_iter_start_author(&txn, it, pk, 1650049977));
+	assert(!ndb_note_iter_next(it));
+	ndb_note_iter_end(it);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+}
+
+static void test_kind_index()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_note_iter iter, *it = &iter;
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_query_result results[4];
+	size_t mapsize;
+	int count;
+
+	mapsize = 1024 * 1024 * 100;
+	assert(ndb_init(&ndb, test_dir, mapsize, 1));
+	assert(ndb_begin_query(ndb, &txn));
+
+	// random.json has a single profile
+	count = 0;
+	assert(ndb_note_iter_start_kind(&txn, it, 0, UINT64_MAX));
+	while (ndb_note_iter_next(it)) {
+		assert(it->note->kind == 0);
+		if (count++ == 0)
+			assert(it->note->created_at == 1650049978);
+	}
+	ndb_note_iter_end(it);
+	assert(count >= 1);
+
+	// latest kind 1 notes in a window
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_field(f, NDB_FILTER_UNTIL));
+	assert(ndb_filter_add_int_element(f, 1650053582));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_field(f, NDB_FILTER_LIMIT));
+	assert(ndb_filter_add_int_element(f, 2));
+	ndb_filter_end_field(f);
+
+	assert(ndb_query(&txn, f, 1, results, ARRAY_SIZE(results), &count));
+	assert(count == 2);
+	assert(results[0].note->created_at == 1650053582);
+	assert(results[1].note->created_at == 1650051200);
+	ndb_filter_destroy(f);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+}
+
+static void test_timeline()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_note_iter iter, *it = &iter;
+	uint64_t last = 1650053582;
+	size_t mapsize;
+	int count = 0;
+
+	mapsize = 1024 * 1024 * 100;
+	assert(ndb_init(&ndb, test_dir, mapsize, 1));
+	assert(ndb_begin_query(ndb, &txn));
+
+	assert(ndb_note_iter_start_created_at(&txn, it, last));
+	while (ndb_note_iter_next(it)) {
+		if (count++ == 0)
+			assert(it->note->created_at == 1650053582);
+		assert(it->note->created_at <= last);
+		last = it->note->created_at;
+	}
+	ndb_note_iter_end(it);
+	assert(count >= 4);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+}
+
+static int count_notes(void *ctx, struct ndb_note *note, size_t len,
+		       uint64_t note_key)
+{
+	int *count = ctx;
+	(*count)++;
+	return 1;
+}
+
+static void test_iter_order()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_note_iter iter, *it = &iter;
+	unsigned char pk[32];
+	uint64_t last_key = 0, last_ts = 0;
+	size_t mapsize;
+	int count = 0, asc = 0;
+
+	mapsize = 1024 * 1024 * 100;
+	assert(ndb_init(&ndb, test_dir, mapsize, 1));
+	assert(ndb_begin_query(ndb, &txn));
+
+	// the note store, lowest key first with prefetching
+	assert(ndb_note_iter_start_note_key(&txn, it, 1));
+	ndb_note_iter_set_flags(it, NDB_ITER_ASCENDING | NDB_ITER_PREFETCH);
+	while (ndb_note_iter_next(it)) {
+		assert(it->note_key > last_key);
+		assert(ndb_note_from_bytes((unsigned char *)it->note));
+		last_key = it->note_key;
+		count++;
+	}
+	ndb_note_iter_end(it);
+	assert(count >= 5);
+
+	// a pubkey's notes oldest first
+	hex_decode("32e1827635450ebb3c5a7d12c1f8e7b2b514439ac10a67eef3d9fd9c5c68e245", 64, pk, 32);
+	assert(ndb_note_iter_start_author(&txn, it, pk, 1650050002));
+	ndb_note_iter_set_flags(it, NDB_ITER_ASCENDING);
+	while (ndb_note_iter_next(it)) {
+		if (asc++ == 0)
+			assert(it->note->created_at == 1650050002);
+		assert(it->note->created_at >= last_ts);
+		last_ts = it->note->created_at;
+	}
+	ndb_note_iter_end(it);
+	assert(asc == 4);
+
+	count = 0;
+	hex_decode("fd3fdb0d0d8d6f9a7667b53211de8ae3c5246b79bdaf64ebac849d5148b5615f", 64, pk, 32);
+	assert(ndb_note_iter_start_tag_id(&txn, it, 'p', pk, UINT64_MAX));
+	assert(ndb_note_iter_foreach(it, count_notes, &count) == 1);
+	ndb_note_iter_end(it);
+	assert(count == 1);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+}
+
+// Sign a kind 1 note with an optional tag and write it out as an EVENT
+// message. None of the strings can need escaping. With `forge_id` the id
+// is flipped before signing, so the signature is good but the id isn't.
+static int sign_event_json(struct ndb_keypair *kp, uint64_t created_at,
+			   const char *content, const char *tag,
+			   const char *value, int forge_id,
+			   char *json, int json_size)
+{
+	struct ndb_builder builder, *b = &builder;
+	struct ndb_note *note;
+	char id[65], pubkey[65], sig[129], *tags;
+	int bufsize, len;
+	unsigned char *buf;
+
+	// strings get less than half of the builder's buffer
+	bufsize = 3 * (strlen(content) + (value ? strlen(value) : 0)) + 4096;
+	assert((buf = malloc(bufsize)));
+	assert((tags = malloc(bufsize)));
+
+	assert(ndb_builder_init(b, buf, bufsize));
+	assert(ndb_builder_set_content(b, content, strlen(content)));
+	ndb_builder_set_kind(b, 1);
+	ndb_builder_set_created_at(b, created_at);
+	tags[0] = '\0';
+	if (tag) {
+		assert(ndb_builder_new_tag(b));
+		assert(ndb_builder_push_tag_str(b, tag, strlen(tag)));
+		assert(ndb_builder_push_tag_str(b, value, strlen(value)));
+		snprintf(tags, bufsize, "[\"%s\",\"%s\"]", tag, value);
+	}
+	assert(ndb_builder_finalize(b, &note, kp));
+
+	if (forge_id) {
+		note->id[0] ^= 0x10;
+		assert(ndb_sign_id(kp, note->id, note->sig));
+	}
+
+	hex_encode(note->id, 32, id, sizeof(id));
+	hex_encode(note->pubkey, 32, pubkey, sizeof(pubkey));
+	hex_encode(note->sig, 64, sig, sizeof(sig));
+
+	len = snprintf(json, json_size, "[\"EVENT\",\"s\",{\"id\":\"%s\",\"pubkey\":\"%s\",\"created_at\":%" PRIu64 ",\"kind\":1,\"tags\":[%s],\"content\":\"%s\",\"sig\":\"%s\"}]",
+		       id, pubkey, created_at, tags, content, sig);
+	assert(len < json_size);
+
+	free(tags);
+	free(buf);
+	return len;
+}
+
+static void test_tag_iter_long_value()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_note_iter iter, *it = &iter;
+	struct ndb_keypair kp;
+	char a[141], b[141], json[1024];
+	size_t mapsize;
+	int len;
+
+	memset(kp.secret, 0x01, sizeof(kp.secret));
+	assert(ndb_create_keypair(&kp));
+
+	// the index only keeps the first 128 chars, these share them
+	memset(a, 'a', 140);
+	a[140] = '\0';
+	memcpy(b, a, sizeof(b));
+	b[139] = 'b';
+
+	mapsize = 1024 * 1024 * 100;
+	assert(ndb_init(&ndb, test_dir, mapsize, 1));
+	len = sign_event_json(&kp, 1001, "long a", "t", a, 0, json, sizeof(json));
+	assert(ndb_process_event(ndb, json, len));
+	len = sign_event_json(&kp, 1002, "long b", "t", b, 0, json, sizeof(json));
+	assert(ndb_process_event(ndb, json, len));
+	ndb_destroy(ndb);
+
+	assert(ndb_init(&ndb, test_dir, mapsize, 1));
+	assert(ndb_begin_query(ndb, &txn));
+
+	assert(ndb_note_iter_start_tag_str(&txn, it, 't', a, UINT64_MAX));
+	assert(ndb_note_iter_next(it));
+	assert(!strcmp(ndb_note_content(it->note), "long a"));
+	assert(!ndb_note_iter_next(it));
+	ndb_note_iter_end(it);
+
+	assert(ndb_note_iter_start_tag_str(&txn, it, 't', b, UINT64_MAX));
+	ndb_note_iter_set_flags(it, NDB_ITER_PREFETCH);
+	assert(ndb_note_iter_next(it));
+	assert(!strcmp(ndb_note_content(it->note), "long b"));
+	assert(!ndb_note_iter_next(it));
+	ndb_note_iter_end(it);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+}
+
+static void test_forged_id()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_keypair kp;
+	unsigned char forged[32], real[32];
+	char json[4096];
+	size_t mapsize;
+	int len;
+
+	memset(kp.secret, 0x03, sizeof(kp.secret));
+	assert(ndb_create_keypair(&kp));
+
+	mapsize = 1024 * 1024 * 100;
+	assert(ndb_init(&ndb, test_dir, mapsize, 1));
+
+	// the signature is good, but it's over an id with a nibble flipped
+	len = sign_event_json(&kp, 3001, "forged", NULL, NULL, 1,
+			      json, sizeof(json));
+	assert(hex_decode(strstr(json, "\"id\":\"") + 6, 64, forged, 32));
+	assert(ndb_process_event(ndb, json, len));
+
+	len = sign_event_json(&kp, 3002, "real", NULL, NULL, 0,
+			      json, sizeof(json));
+	assert(hex_decode(strstr(json, "\"id\":\"") + 6, 64, real, 32));
+	assert(ndb_process_event(ndb, json, len));
+	ndb_destroy(ndb);
+
+	assert(ndb_init(&ndb, test_dir, mapsize, 1));
+	assert(ndb_begin_query(ndb, &txn));
+	assert(ndb_get_note_by_id(&txn, forged, NULL) == NULL);
+	assert(ndb_get_note_by_id(&txn, real, NULL));
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+}
+
+static void test_duplicate_copies()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_keypair kp;
+	struct ndb_filter filter;
+	struct ndb_query_result result;
+	struct ndb_note *note;
+	static const int num_notes = 64, copies = 32;
+	unsigned char id[32];
+	char *json;
+	size_t mapsize;
+	uint64_t min_key, max_key;
+	int *lens, count, i, j;
+
+	memset(kp.secret, 0x04, sizeof(kp.secret));
+	assert(ndb_create_keypair(&kp));
+	assert((json = malloc(num_notes * 1024)));
+	assert((lens = malloc(num_notes * sizeof(*lens))));
+
+	for (i = 0; i < num_notes; i++) {
+		lens[i] = sign_event_json(&kp, 4000 + i, "copies", NULL, NULL,
+					  0, json + i * 1024, 1024);
+	}
+
+	// every ingester gets copies of the same notes, like when many
+	// relays send them at once. some of them show up while the first
+	// copy is being committed.
+	mapsize = 1024 * 1024 * 100;
+	assert(ndb_init(&ndb, test_dir, mapsize, 4));
+	for (j = 0; j < copies; j++) {
+		for (i = 0; i < num_notes; i++)
+			assert(ndb_process_event(ndb, json + i * 1024, lens[i]));
+	}
+	ndb_destroy(ndb);
+
+	assert(ndb_init(&ndb, test_dir, mapsize, 1));
+	assert(ndb_begin_query(ndb, &txn));
+
+	min_key = UINT64_MAX;
+	max_key = 0;
+	for (i = 0; i < num_notes; i++) {
+		assert(hex_decode(strstr(json + i * 1024, "\"id\":\"") + 6,
+				  64, id, 32));
+		assert(ndb_filter_init(&filter));
+		assert(ndb_filter_start_field(&filter, NDB_FILTER_IDS));
+		assert(ndb_filter_add_id_element(&filter, id));
+		ndb_filter_end_field(&filter);
+		assert(ndb_query(&txn, &filter, 1, &result, 1, &count));
+		assert(count == 1);
+		ndb_filter_destroy(&filter);
+
+		if (result.note_key < min_key)
+			min_key = result.note_key;
+		if (result.note_key > max_key)
+			max_key = result.note_key;
+	}
+
+	// the indexes hide any extra copies, but they'd still take up note
+	// keys between or before ours
+	assert(max_key - min_key == num_notes - 1);
+	note = ndb_get_note_by_key(&txn, min_key - 1, NULL);
+	assert(!note || memcmp(note->pubkey, kp.pubkey, 32) ||
+	       note->created_at < 4000);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+	free(lens);
+	free(json);
+}
+
+static void test_note_chunks()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_note *note;
+	struct ndb_keypair kp;
+	static const int num_notes = 48;
+	static const int content_len = 100000, big_len = 600000;
+	unsigned char ids[48][32];
+	char *content, *json;
+	size_t mapsize, len;
+	int i, json_size = big_len + 1024;
+
+	memset(kp.secret, 0x02, sizeof(kp.secret));
+	assert(ndb_create_keypair(&kp));
+	assert((content = malloc(big_len + 1)));
+	assert((json = malloc(json_size)));
+
+	mapsize = 1024 * 1024 * 100;
+	assert(ndb_init(&ndb, test_dir, mapsize, 1));
+
+	// each of these takes up 100k of an ingester's 4mb chunk and needs
+	// 800k of room to be parsed into, so they span several chunks. the
+	// last one is too big for a chunk and gets its own.
+	for (i = 0; i < num_notes; i++) {
+		len = i == num_notes - 1 ? big_len : content_len;
+		memset(content, 'a' + i % 26, len);
+		content[len] = '\0';
+
+		len = sign_event_json(&kp, 2000 + i, content, NULL, NULL, 0,
+				      json, json_size);
+		assert(ndb_process_event(ndb, json, len));
+		assert(hex_decode(strstr(json, "\"id\":\"") + 6, 64, ids[i], 32));
+	}
+
+	// the writer drops its chunk references as it commits
+	ndb_destroy(ndb);
+
+	assert(ndb_init(&ndb, test_dir, mapsize, 1));
+	assert(ndb_begin_query(ndb, &txn));
+	for (i = 0; i < num_notes; i++) {
+		assert((note = ndb_get_note_by_id(&txn, ids[i], NULL)));
+		len = i == num_notes - 1 ? big_len : content_len;
+		assert(ndb_note_content_length(note) == len);
+		assert(ndb_note_content(note)[0] == 'a' + i % 26);
+		assert(ndb_note_content(note)[len - 1] == 'a' + i % 26);
+	}
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+
+	free(json);
+	free(content);
+}
+
+static void *query_and_exit(void *data)
+{
+	struct ndb_txn txn;
+
+	assert(ndb_begin_query((struct ndb *)data, &txn));
+	ndb_end_query(&txn);
+	return NULL;
+}
+
+static void test_reuse_read_txn()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn, nested;
+	pthread_t thread;
+	void *mdb_txn;
+	size_t mapsize;
+
+	mapsize = 1024 * 1024 * 100;
+	assert(ndb_init(&ndb, test_dir, mapsize, 1));
+
+	assert(ndb_begin_query(ndb, &txn));
+	mdb_txn = txn.mdb_txn;
+	ndb_end_query(&txn);
+
+	// the thread's read txn is renewed instead of creating a new one
+	assert(ndb_begin_query(ndb, &txn));
+	assert(txn.mdb_txn == mdb_txn);
+
+	// a thread can only have one query open
+	assert(!ndb_begin_query(ndb, &nested));
+
+	ndb_end_query(&txn);
+
+	// threads that exit give their read txn back on the way out
+	assert(!pthread_create(&thread, NULL, query_and_exit, ndb));
+	assert(!pthread_join(thread, NULL));
+
+	ndb_destroy(ndb);
+}
+
+static void test_tag_query()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_query_result results[4];
+	size_t mapsize;
+	int count;
+	unsigned char id[32];
+
+	// uses the profiles written by test_load_profiles
+	mapsize = 1024 * 1024 * 100;
+	assert(ndb_init(&ndb, test_dir, mapsize, 1));
+	assert(ndb_begin_query(ndb, &txn));
+
+	hex_decode("ad369781d1a7f2c2fabd3a7b7da7aae08d551e4da2094b677b12999b24ff05f4", 64, id, 32);
+
+	// string tag values
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_tag_field(f, 't'));
+	assert(ndb_filter_add_str_element(f, "gitlog"));
+	ndb_filter_end_field(f);
+	assert(ndb_query(&txn, f, 1, results, ARRAY_SIZE(results), &count));
+	assert(count == 1);
+	assert(!memcmp(results[0].note->id, id, 32));
+	ndb_filter_destroy(f);
+
+	// prefixes of a value don't match
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_tag_field(f, 'i'));
+	assert(ndb_filter_add_str_element(f, "github:ty"));
+	ndb_filter_end_field(f);
+	assert(ndb_query(&txn, f, 1, results, ARRAY_SIZE(results), &count));
+	assert(count == 0);
+	ndb_filter_destroy(f);
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_tag_field(f, 'i'));
+	assert(ndb_filter_add_str_element(f, "github:tyiu"));
+	ndb_filter_end_field(f);
+	assert(ndb_query(&txn, f, 1, results, ARRAY_SIZE(results), &count));
+	assert(count == 1);
+	assert(results[0].note->created_at == 1689628259);
+	ndb_filter_destroy(f);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+}
+
+static void test_query_dedupe()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_filter filters[2];
+	struct ndb_query_result results[4];
+	unsigned char a[32], b[32], id[32];
+	size_t mapsize;
+	int count, i;
+
+	// uses the contact list written by test_subscriptions, which tags
+	// both of these pubkeys
+	hex_decode("6cad545430904b84a8101c5783b65043f19ae29d2da1076b8fc3e64892736f03", 64, a, 32);
+	hex_decode("2ef93f01cd2493e04235a6b87b10d3c4a74e2a7eb7c3caf168268f6af73314b5", 64, b, 32);
+	hex_decode("acecfe60e5e886c7b9ee5baeba4cd31fdbeb2c45d390de29712e4a375d16cbc5", 64, id, 32);
+
+	mapsize = 1024 * 1024 * 100;
+	assert(ndb_init(&ndb, test_dir, mapsize, 1));
+	assert(ndb_begin_query(ndb, &txn));
+
+	for (i = 0; i < 2; i++) {
+		assert(ndb_filter_init(&filters[i]));
+		assert(ndb_filter_start_tag_field(&filters[i], 'p'));
+		assert(ndb_filter_add_id_element(&filters[i], a));
+		assert(ndb_filter_add_id_element(&filters[i], b));
+		ndb_filter_end_field(&filters[i]);
+		assert(ndb_filter_start_field(&filters[i], NDB_FILTER_KINDS));
+		assert(ndb_filter_add_int_element(&filters[i], 3));
+		ndb_filter_end_field(&filters[i]);
+	}
+
+	// the note is reached through both tag values, but only comes back
+	// once
+	assert(ndb_query(&txn, filters, 1, results, ARRAY_SIZE(results), &count));
+	assert(count == 1);
+	assert(!memcmp(results[0].note->id, id, 32));
+
+	// and once across filters
+	assert(ndb_query(&txn, filters, 2, results, ARRAY_SIZE(results), &count));
+	assert(count == 1);
+
+	ndb_filter_destroy(&filters[0]);
+	ndb_filter_destroy(&filters[1]);
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+}
+
+static void count_wakeups(void *ctx, uint64_t subid)
+{
+	int *wakeups = ctx;
+	(*wakeups)++;
+}
+
+struct sub_waiter {
+	struct ndb *ndb;
+	uint64_t subid;
+	pthread_t thread;
+	int count;
+};
+
+static void *wait_for_notes_thread(void *data)
+{
+	struct sub_waiter *w = data;
+	uint64_t note_keys[4];
+
+	w->count = ndb_wait_for_notes(w->ndb, w->subid, note_keys, 4);
+	return NULL;
+}
+
+static void test_subscriptions()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_filter filters[4];
+	struct ndb_note *note;
+	uint64_t subid, other, multi, note_keys[4];
+	struct sub_waiter waiters[2];
+	unsigned char id[32], pk[32];
+	static const int alloc_size = 2 << 18;
+	char *json = malloc(alloc_size);
+	size_t mapsize;
+	int written, wakeups = 0;
+
+	mapsize = 1024 * 1024 * 100;
+	assert(ndb_init(&ndb, test_dir, mapsize, 1));
+	ndb_set_subscription_callback(ndb, count_wakeups, &wakeups);
+
+	// indexed by its #p value
+	hex_decode("2ef93f01cd2493e04235a6b87b10d3c4a74e2a7eb7c3caf168268f6af73314b5", 64, pk, 32);
+	assert(ndb_filter_init(&filters[0]));
+	assert(ndb_filter_start_field(&filters[0], NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(&filters[0], 3));
+	ndb_filter_end_field(&filters[0]);
+	assert(ndb_filter_start_tag_field(&filters[0], 'p'));
+	assert(ndb_filter_add_id_element(&filters[0], pk));
+	ndb_filter_end_field(&filters[0]);
+	assert((subid = ndb_subscribe(ndb, &filters[0], 1)));
+
+	assert(ndb_filter_init(&filters[1]));
+	assert(ndb_filter_start_field(&filters[1], NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(&filters[1], 1));
+	ndb_filter_end_field(&filters[1]);
+	assert((other = ndb_subscribe(ndb, &filters[1], 1)));
+	assert(other != subid);
+
+	// an indexed and an unindexed filter that both match only queue the
+	// note once
+	hex_decode("32e1827635450ebb3c5a7d12c1f8e7b2b514439ac10a67eef3d9fd9c5c68e245", 64, pk, 32);
+	assert(ndb_filter_init(&filters[2]));
+	assert(ndb_filter_start_field(&filters[2], NDB_FILTER_AUTHORS));
+	assert(ndb_filter_add_id_element(&filters[2], pk));
+	ndb_filter_end_field(&filters[2]);
+	assert(ndb_filter_init(&filters[3]));
+	assert(ndb_filter_start_field(&filters[3], NDB_FILTER_SINCE));
+	assert(ndb_filter_add_int_element(&filters[3], 1690000000));
+	ndb_filter_end_field(&filters[3]);
+	assert((multi = ndb_subscribe(ndb, &filters[2], 2)));
+
+	assert(read_file("testdata/contacts-event.json", (unsigned char*)json,
+			 alloc_size, &written));
+	// copies that are in flight together are only written once
+	assert(ndb_process_event(ndb, json, written));
+	assert(ndb_process_event(ndb, json, written));
+	assert(ndb_process_event(ndb, json, written));
+
+	assert(ndb_wait_for_notes(ndb, subid, note_keys, 4) == 1);
+	assert(ndb_wait_for_notes(ndb, multi, note_keys + 1, 3) == 1);
+	assert(note_keys[0] == note_keys[1]);
+	assert(ndb_poll_for_notes(ndb, multi, note_keys + 1, 3) == 0);
+	assert(ndb_poll_for_notes(ndb, other, note_keys + 1, 3) == 0);
+
+	hex_decode("acecfe60e5e886c7b9ee5baeba4cd31fdbeb2c45d390de29712e4a375d16cbc5", 64, id, 32);
+	assert(ndb_begin_query(ndb, &txn));
+	assert((note = ndb_get_note_by_key(&txn, note_keys[0], NULL)));
+	assert(!memcmp(note->id, id, 32));
+	ndb_end_query(&txn);
+
+	assert(ndb_unsubscribe(ndb, subid));
+	assert(!ndb_unsubscribe(ndb, subid));
+	assert(ndb_poll_for_notes(ndb, subid, note_keys, 4) == 0);
+
+	// waiters are woken when their subscription goes away, whether
+	// it's unsubscribed or the db is closed
+	waiters[0].subid = other;
+	waiters[1].subid = multi;
+	for (int i = 0; i < 2; i++) {
+		waiters[i].ndb = ndb;
+		waiters[i].count = -1;
+		assert(!pthread_create(&waiters[i].thread, NULL,
+				       wait_for_notes_thread, &waiters[i]));
+	}
+	usleep(10000);
+	assert(ndb_unsubscribe(ndb, other));
+	assert(!pthread_join(waiters[0].thread, NULL));
+	assert(waiters[0].count == 0);
+
+	ndb_destroy(ndb);
+	assert(!pthread_join(waiters[1].thread, NULL));
+	assert(waiters[1].count == 0);
+	assert(wakeups == 2);
+	free(json);
+}
+
+static void count_release(void *ctx, const char *json, int len)
+{
+	int *released = ctx;
+	(*released)++;
+}
+
+static void test_process_event_release()
+{
+	struct ndb *ndb;
+	static const int alloc_size = 2 << 18;
+	static const char *bad = "[\"EVENT\",\"s\",{\"id\":\"nope\"}]";
+	char *json = malloc(alloc_size);
+	char *forged, *p;
+	struct ndb_txn txn;
+	struct ndb_note_iter iter;
+	unsigned char pk[32], id[32];
+	size_t mapsize;
+	int written, released = 0, count = 0;
+
+	mapsize = 1024 * 1024 * 100;
+	assert(ndb_init(&ndb, test_dir, mapsize, 1));
+
+	assert(read_file("testdata/contacts-event.json", (unsigned char*)json,
+			 alloc_size, &written));
+
+	// buffers are handed back whether the event was a duplicate or
+	// failed to parse
+	assert(ndb_process_event_with_release(ndb, json, written,
+					      count_release, &released));
+	assert(ndb_process_event_with_release(ndb, bad, strlen(bad),
+					      count_release, &released));
+
+	// a copy claiming an id that isn't the hash of its contents
+	json[written] = '\0';
+	forged = strdup(json);
+	assert((p = strstr(forged, "acecfe60")));
+	p[0] = 'b';
+	assert(ndb_process_event_with_release(ndb, forged, written,
+					      count_release, &released));
+
+	// threads are joined here, so they're done with our buffers
+	ndb_destroy(ndb);
+	assert(released == 3);
+
+	// the note was already stored before we opened the db, so it must
+	// not have been written again
+	assert(ndb_init(&ndb, test_dir, mapsize, 1));
+	assert(ndb_begin_query(ndb, &txn));
+	hex_decode("32e1827635450ebb3c5a7d12c1f8e7b2b514439ac10a67eef3d9fd9c5c68e245", 64, pk, 32);
+	assert(ndb_note_iter_start_author(&txn, &iter, pk, UINT64_MAX));
+	assert(ndb_note_iter_foreach(&iter, count_notes, &count) == 6);
+	ndb_note_iter_end(&iter);
+	hex_decode(p, 64, id, 32);
+	assert(!ndb_get_note_by_id(&txn, id, NULL));
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+
+	free(forged);
+	free(json);
+}
+
+static void test_import_file()
+{
+	struct ndb *ndb;
+	struct ndb_filter filter;
+	static const char *path = "./testdata/db/import.ldjson";
+	static const char *bad = "[\"EVENT\",\"s\",{\"id\":\"nope\"}]\n\n";
+	static const int alloc_size = 1024 * 1024;
+	unsigned char *json = malloc(alloc_size);
+	unsigned char id[32];
+	uint64_t subid, note_key;
+	struct ndb_txn txn;
+	size_t mapsize;
+	int written;
+	char *sig;
+	FILE *file;
+
+	// a garbage line and an empty line before the profiles
+	assert(read_file("testdata/profiles.json", json, alloc_size, &written));
+
+	// the first profile gets a bad signature, which should only drop
+	// that one from its verification batch
+	json[written] = '\0';
+	assert((sig = strstr((char *)json, "\"sig\":\"a60ce5ab")));
+	memcpy(sig + 7, "ffff", 4);
+
+	assert((file = fopen(path, "w")));
+	fputs(bad, file);
+	fwrite(json, written, 1, file);
+	fclose(file);
+
+	mapsize = 1024 * 1024 * 100;
+	assert(ndb_init(&ndb, test_dir, mapsize, 2));
+
+	assert(ndb_filter_init(&filter));
+	assert(ndb_filter_start_field(&filter, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(&filter, 0));
+	ndb_filter_end_field(&filter);
+	assert((subid = ndb_subscribe(ndb, &filter, 1)));
+
+	assert(ndb_import_file(ndb, path));
+	assert(ndb_wait_for_notes(ndb, subid, &note_key, 1) == 1);
+
+	ndb_destroy(ndb);
+
+	assert(ndb_init(&ndb, test_dir, mapsize, 2));
+	assert(ndb_begin_query(ndb, &txn));
+	hex_decode("7464c4478ca40a562613f02d379a185a2272d25b1d06f3c509ca94cf57401e90", 64, id, 32);
+	assert(!ndb_get_note_by_id(&txn, id, NULL));
+	hex_decode("c7848f8fa7608cad60dfb6f49f73ff11411f19c299f529d621ac83dc54b99e37", 64, id, 32);
+	assert(ndb_get_note_by_id(&txn, id, NULL));
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+
+	unlink(path);
+	free(json);
+}
+
 static void test_parse_contact_event()
 {
 	int written;
@@ -382,6 +1370,39 @@ static void test_parse_json() {
 	assert(!strcmp(ndb_iter_tag_str(it, 2).str, "w"));
 }
 
+static void test_unescape_content() {
+	unsigned char buffer[2048];
+	struct ndb_note *note;
+	static const char *json =
+		"{\"id\": \"" HEX_ID "\",\"pubkey\": \"" HEX_PK "\",\"created_at\": 1689836342,\"kind\": 1,\"tags\": [],\"content\": \"a long run of plain text before any escapes\\n\\\"quoted\\\" \\\\path\\/to\\tend\\\\\",\"sig\": \"e4d528651311d567f461d7be916c37cbf2b4d530e672f29f15f353291ed6df60c665928e67d2f18861c5ca88\"}";
+
+	assert(ndb_note_from_json(json, strlen(json), &note, buffer, sizeof(buffer)));
+	assert(!strcmp(ndb_note_content(note), "a long run of plain text before any escapes\n\"quoted\" \\path/to\tend\\"));
+	assert(ndb_note_content_length(note) == strlen(ndb_note_content(note)));
+#undef HEX_ID
+#undef HEX_PK
+}
+
+static void test_calculate_id() {
+	unsigned char buffer[4096], id[32], expected[32];
+	struct ndb_note *note;
+	// escapes, an escaped single character tag and an uppercase hex tag
+	// all have to serialize back to what was signed
+	static const char *json =
+		"{\"id\": \"5c01ce19430438b05799624801f2bcadba72b6d03a42a3d294a3da22b2b02f1d\",\"pubkey\": \"32e1827635450ebb3c5a7d12c1f8e7b2b514439ac10a67eef3d9fd9c5c68e245\",\"created_at\": 1700000000,\"kind\": 1,\"tags\": [[\"t\",\"\\n\"],[\"r\",\"ACECFE60E5E886C7B9EE5BAEBA4CD31FDBEB2C45D390DE29712E4A375D16CBC5\"],[\"e\",\"acecfe60e5e886c7b9ee5baeba4cd31fdbeb2c45d390de29712e4a375d16cbc5\",\"\\\"q\\\"\"]],\"content\": \"tab\\there\\nquote \\\" slash \\\\ solidus \\/\",\"sig\": \"e4d528651311d567f461d7be916c37cbf2b4d530e672f29f15f353291ed6df60c665928e67d2f18861c5ca88e4d528651311d567f461d7be916c37cb\"}";
+
+	hex_decode("5c01ce19430438b05799624801f2bcadba72b6d03a42a3d294a3da22b2b02f1d", 64, expected, 32);
+
+	assert(ndb_note_from_json(json, strlen(json), &note, buffer, sizeof(buffer)));
+	assert(!strcmp(ndb_tag_str(note, &note->tags.tag[0], 1).str, "\n"));
+
+	memcpy(id, note->id, 32);
+	memset(note->id, 0, 32);
+	assert(ndb_calculate_id(note, NULL, 0));
+	assert(!memcmp(note->id, expected, 32));
+	assert(!memcmp(note->id, id, 32));
+}
+
 static void test_strings_work_before_finalization() {
 	struct ndb_builder builder, *b = &builder;
 	struct ndb_note *note;
@@ -397,6 +1418,57 @@ static void test_strings_work_before_finalization() {
 	assert(!strcmp(ndb_note_str(b->note, &b->note->content).str, "hello"));
 }
 
+static void test_builder_dedupe() {
+	struct ndb_builder builder, *b = &builder;
+	struct ndb_note *note;
+	struct ndb_iterator iter, *it = &iter;
+	union ndb_packed_str strs[4];
+	unsigned char buf[4096], id[32];
+	int i;
+	static const char *relay = "wss://relay.damus.io";
+	static const char *json =
+		"{\"id\": \"622f34e38036f5194b8457c1bcd37f5345a4b341a6dc29799b9d9de1994967d8\",\"pubkey\": \"b169f596968917a1abeb4234d3cf3aa9baee2112e58998d17c6db416ad33fe40\",\"created_at\": 1689836342,\"kind\": 10002,\"tags\": [[\"r\",\"wss://relay.damus.io\"],[\"p\",\"b169f596968917a1abeb4234d3cf3aa9baee2112e58998d17c6db416ad33fe40\"],[\"r\",\"wss://relay.damus.io\",\"read\"],[\"p\",\"b169f596968917a1abeb4234d3cf3aa9baee2112e58998d17c6db416ad33fe40\"]],\"content\": \"read\",\"sig\": \"e4d528651311d567f461d7be916c37cbf2b4d530e672f29f15f353291ed6df60c665928e67d2f18861c5ca88\"}";
+
+	assert(ndb_builder_init(b, buf, sizeof(buf)));
+	assert(ndb_builder_set_content(b, "hello", 5));
+	assert(ndb_builder_new_tag(b));
+	assert(ndb_builder_push_tag_str(b, relay, strlen(relay)));
+	assert(ndb_builder_push_tag_str(b, "wss://relay", 11));
+	assert(ndb_builder_push_tag_str(b, relay, strlen(relay)));
+	assert(ndb_builder_push_tag_str(b, "hello", 5));
+	assert(ndb_builder_finalize(b, &note, NULL));
+
+	ndb_tags_iterate_start(note, it);
+	assert(ndb_tags_iterate_next(it));
+	for (i = 0; i < 4; i++)
+		strs[i] = it->tag->strs[i];
+
+	// equal strings are stored once, even the content, but a prefix of
+	// a string isn't that string
+	assert(strs[0].offset == strs[2].offset);
+	assert(strs[3].offset == note->content.offset);
+	assert(!strcmp(ndb_iter_tag_str(it, 1).str, "wss://relay"));
+	assert(!strcmp(ndb_iter_tag_str(it, 2).str, relay));
+
+	// same for json strings and ids
+	assert(ndb_note_from_json(json, strlen(json), &note, buf, sizeof(buf)));
+	ndb_tags_iterate_start(note, it);
+	for (i = 0; i < 4; i++) {
+		assert(ndb_tags_iterate_next(it));
+		strs[i] = it->tag->strs[1];
+	}
+	assert(strs[0].offset == strs[2].offset);
+	assert(it->tag->strs[1].offset == strs[1].offset);
+	assert(ndb_iter_tag_str(it, 1).flag == NDB_PACKED_ID);
+	assert(!strcmp(ndb_note_content(note), "read"));
+
+	// and the note still serializes to its id
+	memcpy(id, note->id, 32);
+	memset(note->id, 0, 32);
+	assert(ndb_calculate_id(note, NULL, 0));
+	assert(!memcmp(id, note->id, 32));
+}
+
 static void test_tce_eose() {
 	unsigned char buf[1024];
 	const char json[] = "[\"EOSE\",\"s\"]";
@@ -465,6 +1537,129 @@ static void test_tce() {
 #undef JSON
 }
 
+static enum ndb_idres record_id(void *ctx, const char *hexid)
+{
+	memcpy(ctx, hexid, 64);
+	return NDB_IDRES_STOP;
+}
+
+static enum ndb_idres count_ids(void *ctx, const char *hexid)
+{
+	int *count = ctx;
+	(*count)++;
+	return NDB_IDRES_CONT;
+}
+
+// the id is found up front even when it's last and other fields look like it
+static void test_sniff_event_id() {
+#define HEX_ID "5004a081e397c6da9dc2f2d6b3134006a9d0e8c1b46689d9fe150bb2f21a204d"
+#define HEX_PK "b169f596968917a1abeb4234d3cf3aa9baee2112e58998d17c6db416ad33fe40"
+#define FIELDS "\"pubkey\": \"" HEX_PK "\",\"created_at\": 1689836342,\"kind\": 1,\"tags\": [[\"id\",\"" HEX_PK "\"], [\"word\", \"words\", \"w\"]],\"content\": \"{\\\"id\\\":\\\"" HEX_PK "\\\"}\",\"sig\": \"e4d528651311d567f461d7be916c37cbf2b4d530e672f29f15f353291ed6df60c665928e67d2f18861c5ca88\", \"id\" : \"" HEX_ID "\"}"
+#define JSON "{" FIELDS
+#define DECOY "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+	unsigned char buf[1024];
+	char seen[65] = {0};
+	const char json[] = "[ \"EVENT\", \"sub\\\"id\", " JSON "]";
+	const char dup[] = "[\"EVENT\",\"sub\",{\"tags\":[[\"id\",\"" HEX_PK "\"]],\"id\":\"" DECOY "\"," FIELDS "]";
+	unsigned char id[32];
+	struct ndb_tce tce;
+	struct ndb_id_cb cb = { record_id, seen };
+	int count = 0;
+
+	assert(ndb_ws_event_from_json(json, sizeof(json), &tce, buf, sizeof(buf), &cb) == -42);
+	assert(!strcmp(seen, HEX_ID));
+
+	// the parser doesn't check the id a second time
+	cb.fn = count_ids;
+	cb.data = &count;
+	assert(ndb_ws_event_from_json(json, sizeof(json), &tce, buf, sizeof(buf), &cb));
+	assert(tce.evtype == NDB_TCE_EVENT);
+	assert(count == 1);
+
+	// the id tag doesn't count as the event's id
+	hex_decode(HEX_ID, 64, id, 32);
+	assert(!memcmp(tce.event.note->id, id, 32));
+
+	// with a decoy id in front of the real one, the sniffer leaves it
+	// to the parser, which won't take an event with two ids
+	cb.fn = record_id;
+	cb.data = seen;
+	assert(ndb_ws_event_from_json(dup, sizeof(dup), &tce, buf, sizeof(buf), &cb) == -42);
+	assert(strcmp(seen, DECOY));
+
+	cb.fn = count_ids;
+	cb.data = &count;
+	count = 0;
+	assert(ndb_ws_event_from_json(dup, sizeof(dup), &tce, buf, sizeof(buf), &cb) == 0);
+	assert(count == 1);
+	assert(ndb_ws_event_from_json(dup, sizeof(dup), &tce, buf, sizeof(buf), NULL) == 0);
+
+#undef HEX_ID
+#undef HEX_PK
+#undef FIELDS
+#undef JSON
+#undef DECOY
+}
+
+// the indexer must agree with jsmn on everything it accepts
+static void check_json_index(const char *json, int len)
+{
+	static jsmntok_t a[16384], b[16384];
+	jsmn_parser p;
+	int r1, r2;
+
+	jsmn_init(&p);
+	r1 = jsmn_parse(&p, json, len, a, ARRAY_SIZE(a), 0);
+	r2 = json_index_parse(json, len, b, ARRAY_SIZE(b));
+
+	if (r2 >= 0) {
+		assert(r1 == r2);
+		assert(!memcmp(a, b, r1 * sizeof(*a)));
+	}
+}
+
+static void test_json_index() {
+	static const int alloc_size = 2 << 18;
+	static const char *docs[] = {
+		"[\"a\\\\\\\"b\\\\\", 1, {\"k\": [true,null,-1.5e3]},\"\\u00e9\\/\"]",
+		"{\"a\":{\"b\":[[],{}]},\"c\":\"}]\\\\\"}",
+		"[\"unterminated",
+		"[\"bad \\x escape\"]",
+		"[1, 2",
+		"[tru\"e\"]",
+		"{\"k\":1]",
+		"[\"after\",\"nul\"]\0,garbage",
+	};
+	unsigned char *json = malloc(alloc_size);
+	char buf[256], *line, *next;
+	int written, i, pad, len;
+
+	// move everything across block boundaries
+	for (i = 0; i < (int)ARRAY_SIZE(docs); i++) {
+		len = strlen(docs[i]);
+		if (i == ARRAY_SIZE(docs) - 1)
+			len += 9;
+		for (pad = 0; pad < 70; pad++) {
+			memset(buf, ' ', pad);
+			memcpy(buf + pad, docs[i], len);
+			check_json_index(buf, pad + len);
+		}
+	}
+
+	assert(read_file("testdata/contacts.json", json, alloc_size, &written));
+	check_json_index((const char *)json, written);
+
+	assert(read_file("testdata/profiles.json", json, alloc_size, &written));
+	json[written] = 0;
+	for (line = (char *)json; *line; line = next + 1) {
+		if (!(next = strchr(line, '\n')))
+			break;
+		check_json_index(line, next - line);
+	}
+
+	free(json);
+}
+
 #define TEST_BUF_SIZE 10  // For simplicity
 
 static void test_queue_init_pop_push() {
@@ -571,6 +1766,170 @@ static void test_queue_boundary_conditions() {
     assert(old_count == q.count);
 }
 
+static void *pop_later(void *arg) {
+    struct prot_queue *q = arg;
+    int data[TEST_BUF_SIZE];
+
+    usleep(10000);
+    assert(prot_queue_pop_all(q, data, 3) == 3);
+    return NULL;
+}
+
+static void test_queue_push_wait() {
+    struct prot_queue q;
+    int buffer[TEST_BUF_SIZE], data[TEST_BUF_SIZE];
+    int popped, total = 0;
+    pthread_t thread;
+
+    assert(prot_queue_init(&q, buffer, sizeof(buffer), sizeof(int)) == 1);
+
+    for (int i = 0; i < TEST_BUF_SIZE; i++) {
+        data[i] = i;
+        assert(prot_queue_push(&q, &data[i]) == 1);
+    }
+
+    // more than the queue can ever hold fails instead of waiting
+    assert(prot_queue_push_all_wait(&q, data, TEST_BUF_SIZE + 1) == 0);
+
+    // blocks until the other thread makes room
+    assert(!pthread_create(&thread, NULL, pop_later, &q));
+    assert(prot_queue_push_all_wait(&q, data, 3) == 3);
+    assert(q.count == TEST_BUF_SIZE);
+    assert(!pthread_join(thread, NULL));
+
+    // what's queued can still be popped after closing, then pops stop
+    // blocking
+    prot_queue_close(&q);
+    while ((popped = prot_queue_pop_all(&q, data, TEST_BUF_SIZE)))
+        total += popped;
+    assert(total == TEST_BUF_SIZE);
+
+    prot_queue_destroy(&q);
+}
+
+static void test_hex()
+{
+	unsigned char bytes[100], decoded[100], ids[3][32], ok[3];
+	char hex[201], bad;
+	const char *strs[3];
+	size_t i, n;
+
+	for (i = 0; i < sizeof(bytes); i++)
+		bytes[i] = i * 37 + 11;
+
+	// round trip every length, across the vectorized and scalar parts
+	for (n = 0; n <= sizeof(bytes); n++) {
+		assert(hex_encode(bytes, n, hex, sizeof(hex)));
+		assert(strlen(hex) == n * 2);
+		assert(hex_decode(hex, n * 2, decoded, n));
+		assert(!memcmp(bytes, decoded, n));
+	}
+	assert(!strncmp(hex, "0b30557a9fc4e90e", 16));
+
+	// a bad character is caught wherever it is
+	for (i = 0; i < 200; i++) {
+		bad = hex[i];
+		hex[i] = i % 2 ? 'g' : '/';
+		assert(!hex_decode(hex, 200, decoded, 100));
+		hex[i] = bad;
+	}
+	assert(!hex_decode(hex, 199, decoded, 100));
+	assert(!hex_decode(hex, 200, decoded, 99));
+
+	// uppercase is hex, but not an id as it appears in events
+	hex[70] = 'A';
+	hex[3] = 'B';
+	assert(hex_decode(hex, 200, decoded, 100));
+	strs[0] = hex;
+	strs[1] = hex + 64;
+	strs[2] = hex + 128;
+	assert(hex_decode_ids(strs, 3, ids, ok) == 1);
+	assert(!ok[0] && !ok[1] && ok[2]);
+	assert(!memcmp(ids[2], bytes + 64, 32));
+}
+
+static void test_sha256()
+{
+	static unsigned char buf[1000];
+	size_t i, off;
+	struct sha256 hash, split;
+	struct sha256_ctx ctx;
+	unsigned char expected[32];
+
+	hex_decode("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", 64, expected, 32);
+	sha256(&hash, "abc", 3);
+	assert(!memcmp(hash.u.u8, expected, 32));
+
+	hex_decode("248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1", 64, expected, 32);
+	sha256(&hash, "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 56);
+	assert(!memcmp(hash.u.u8, expected, 32));
+
+	// one million a's, fed in uneven pieces
+	hex_decode("cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0", 64, expected, 32);
+	memset(buf, 'a', sizeof(buf));
+	sha256_init(&ctx);
+	for (i = 0, off = 1; i < 1000000; i += off, off = off % 997 + 1)
+		sha256_update(&ctx, buf, i + off > 1000000 ? 1000000 - i : off);
+	sha256_done(&ctx, &hash);
+	assert(!memcmp(hash.u.u8, expected, 32));
+
+	// the block functions agree with the padding around block edges,
+	// whether the input is split up or not
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 131 + 7;
+	for (i = 0; i < 300; i++) {
+		sha256_init(&ctx);
+		sha256_update(&ctx, buf + 1, i / 3);
+		sha256_update(&ctx, buf + 1 + i / 3, i - i / 3);
+		sha256_done(&ctx, &split);
+		sha256(&hash, buf + 1, i);
+		assert(!memcmp(hash.u.u8, split.u.u8, 32));
+	}
+}
+
+static void test_inflight()
+{
+	struct ndb_inflight set;
+	unsigned char id[32], sig[64], other_sig[64];
+	int slot, other;
+
+	memset(id, 0x42, sizeof(id));
+	memset(sig, 0x24, sizeof(sig));
+	memcpy(other_sig, sig, sizeof(sig));
+	other_sig[63] ^= 1;
+
+	assert(ndb_inflight_init(&set));
+
+	assert(ndb_inflight_claim(&set, id, sig, &slot));
+	assert(slot >= 0);
+
+	// a copy is dropped while the first one is in flight
+	assert(!ndb_inflight_claim(&set, id, sig, &other));
+
+	// a copy with a different sig gets its own slot
+	assert(ndb_inflight_claim(&set, id, other_sig, &other));
+	assert(other >= 0 && other != slot);
+	ndb_inflight_clear(&set, other);
+
+	// once it's committed, the next copy can claim it again
+	ndb_inflight_clear(&set, slot);
+	assert(ndb_inflight_claim(&set, id, sig, &slot));
+	assert(slot >= 0);
+	ndb_inflight_clear(&set, slot);
+
+	// fill the probe window, the rest go untracked
+	for (other = 0; other < INFLIGHT_PROBES; other++) {
+		sig[0] = other;
+		assert(ndb_inflight_claim(&set, id, sig, &slot));
+		assert(slot >= 0);
+	}
+	sig[0] = other;
+	assert(ndb_inflight_claim(&set, id, sig, &slot));
+	assert(slot == -1);
+
+	ndb_inflight_destroy(&set);
+}
+
 static void test_fast_strchr()
 {
 	// Test 1: Basic test
@@ -599,34 +1958,83 @@ static void test_fast_strchr()
 	// Test 7: Large string test (>16 bytes)
 	char *testStr6 = "This is a test for large strings with more than 16 bytes.";
 	assert(fast_strchr(testStr6, 'm', strlen(testStr6)) == testStr6 + 38);
+
+	// Test 8: the first of several characters, at every offset on both
+	// sides of the vector widths
+	char buf[200];
+	for (int i = 0; i < (int)sizeof(buf); i++) {
+		memset(buf, 'a', sizeof(buf));
+		buf[i] = i % 2 ? '"' : '\\';
+		if (i + 3 < (int)sizeof(buf))
+			buf[i + 3] = '"';
+		assert(fast_strchr_any(buf, "\"\\", 2, sizeof(buf)) == buf + i);
+		assert(fast_strchr_any(buf, "xyz\"", 4, sizeof(buf)) ==
+		       (i % 2 ? buf + i : (i + 3 < (int)sizeof(buf) ? buf + i + 3 : NULL)));
+		assert(fast_strchr(buf, '\\', i) == NULL);
+		assert(fast_strchr_any(buf, "b", 1, sizeof(buf)) == NULL);
+	}
 }
 
 int main(int argc, const char *argv[]) {
 	test_basic_event();
 	test_empty_tags();
 	test_parse_json();
+	test_unescape_content();
+	test_calculate_id();
 	test_parse_contact_list();
 	test_strings_work_before_finalization();
+	test_builder_dedupe();
 	test_tce();
 	test_tce_command_result();
 	test_tce_eose();
 	test_tce_command_result_empty_msg();
+	test_sniff_event_id();
+	test_json_index();
 	test_content_len();
 	test_fuzz_events();
 
 	// note fetching
 	test_fetch_last_noteid();
 
+	// queries
+	test_multi_get();
+	test_filters();
+	test_query();
+	test_author_iter();
+	test_kind_index();
+	test_timeline();
+	test_reuse_read_txn();
+	test_iter_order();
+
 	// protected queue tests
 	test_queue_init_pop_push();
 	test_queue_thread_safety();
 	test_queue_boundary_conditions();
+	test_queue_push_wait();
+
+	// in flight note set
+	test_inflight();
 
 	// memchr stuff
 	test_fast_strchr();
 
+	// hashing
+	test_hex();
+	test_sha256();
+
 	// profiles
+	test_import_file();
 	test_load_profiles();
+	test_tag_query();
+
+	// subscriptions
+	test_subscriptions();
+	test_query_dedupe();
+	test_process_event_release();
+	test_tag_iter_long_value();
+	test_forged_id();
+	test_duplicate_copies();
+	test_note_chunks();
 
 	printf("All tests passed!\n");       // Print this if all tests pass.
 }
@@ -83,17 +83,22 @@ static inline int threadpool_dispatch_all(struct threadpool *tp, void *msgs,
 	return prot_queue_push_all(&t->inbox, msgs, num_msgs);
 }
 
+// like threadpool_dispatch_all, but waits for the next thread to have room
+static inline int threadpool_dispatch_all_wait(struct threadpool *tp,
+					       void *msgs, int num_msgs)
+{
+	struct thread *t = threadpool_next_thread(tp);
+	return prot_queue_push_all_wait(&t->inbox, msgs, num_msgs);
+}
+
 static inline void threadpool_destroy(struct threadpool *tp)
 {
 	struct thread *t;
 
 	for (uint64_t i = 0; i < tp->num_threads; i++) {
 		t = &tp->pool[i];
-		if (!prot_queue_push(&t->inbox, tp->quit_msg)) {
-			pthread_exit(&t->thread_id);
-		} else {
-			pthread_join(t->thread_id, NULL);
-		}
+		prot_queue_push_wait(&t->inbox, tp->quit_msg);
+		pthread_join(t->thread_id, NULL);
 		prot_queue_destroy(&t->inbox);
 		free(t->qmem);
 	}